@@ -0,0 +1,206 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+
+#include "smart_pointers.hpp"
+
+// A SharedPtr slot that threads can read and replace concurrently without a
+// lock, using split reference counting. The slot word packs the control
+// block pointer (x86-64 user addresses fit in the low 48 bits) with a
+// 16-bit count of references handed out. The slot owns kPrepaid shared
+// references on the block up front, so load() is a single fetch_add that
+// claims one of them; the loader that claims half of them buys the same
+// number again and takes them off the count. Whoever replaces the block
+// gets back the references not yet claimed. This holds as long as fewer
+// than kPrepaid / 2 loads of one slot are in flight at a time.
+//
+// The prepaid references go into the 32-bit shared count of the block, of
+// which the slots may take half: one block can be in fewer than 2^31 /
+// kPrepaid = 262144 slots at a time. Storing it into more throws
+// std::overflow_error and leaves the slot as it was.
+//
+// Only the control block is stored, so aliased SharedPtrs, whose pointer is
+// not the block's object, are rejected with std::invalid_argument, as are
+// blocks at addresses that do not fit in 48 bits.
+// Comparisons in compare_exchange are by control block, and use_count() of
+// a block in a slot includes the references the slot has prepaid.
+template <typename T, typename Policy = MultiThreadPolicy>
+class AtomicSharedPtr {
+ public:
+  static_assert(sizeof(void*) == 8, "The slot packs a 48-bit pointer");
+  static_assert(!std::is_same_v<Policy, BiasedThreadPolicy>,
+                "Biased counts cannot be prepaid across threads");
+
+  AtomicSharedPtr() : word_(0) {}
+
+  explicit AtomicSharedPtr(SharedPtr<T, Policy> desired)
+      : word_(adopt(std::move(desired))) {}
+
+  AtomicSharedPtr(const AtomicSharedPtr&) = delete;
+
+  AtomicSharedPtr& operator=(const AtomicSharedPtr&) = delete;
+
+  SharedPtr<T, Policy> load() const;
+
+  void store(SharedPtr<T, Policy> desired) { exchange(std::move(desired)); }
+
+  SharedPtr<T, Policy> exchange(SharedPtr<T, Policy> desired);
+
+  // On failure expected is set to the current value.
+  bool compare_exchange_weak(SharedPtr<T, Policy>& expected,
+                             SharedPtr<T, Policy> desired) {
+    return compare_exchange(expected, desired, true);
+  }
+
+  bool compare_exchange_strong(SharedPtr<T, Policy>& expected,
+                               SharedPtr<T, Policy> desired) {
+    return compare_exchange(expected, desired, false);
+  }
+
+  static constexpr bool is_always_lock_free =
+      std::atomic<uint64_t>::is_always_lock_free;
+
+  ~AtomicSharedPtr() { release_word(word_.load(std::memory_order_acquire)); }
+
+ private:
+  using BasePtrCounter = typename SharedPtr<T, Policy>::BasePtrCounter;
+
+  static constexpr uint32_t kPrepaid = 0x2000;
+  // The part of a block's shared count that prepaying may fill; the rest is
+  // for SharedPtrs and for prepays racing past the check.
+  static constexpr uint32_t kMaxPrepaid = uint32_t{1} << 31;
+  static constexpr int kCountShift = 48;
+  static constexpr uint64_t kCountOne = uint64_t{1} << kCountShift;
+  static constexpr uint64_t kPointerMask = kCountOne - 1;
+
+  static BasePtrCounter* counter_of(uint64_t word) {
+    return reinterpret_cast<BasePtrCounter*>(word & kPointerMask);
+  }
+
+  static uint32_t claimed_of(uint64_t word) {
+    return static_cast<uint32_t>(word >> kCountShift);
+  }
+
+  static uint64_t word_of(BasePtrCounter* counter) {
+    uint64_t word = reinterpret_cast<uint64_t>(counter);
+    if (word & ~kPointerMask) {
+      throw std::invalid_argument(
+          "Адрес счётчика не помещается в 48 бит AtomicSharedPtr");
+    }
+    return word;
+  }
+
+  static void prepay(BasePtrCounter* counter, uint32_t count) {
+    if (counter->get_shared_count() > kMaxPrepaid - count) {
+      throw std::overflow_error(
+          "Объект хранится в слишком многих AtomicSharedPtr");
+    }
+    counter->increment_shared_count_by(count);
+  }
+
+  // Turns desired's reference into the kPrepaid the slot holds.
+  static uint64_t adopt(SharedPtr<T, Policy> desired) {
+    BasePtrCounter* counter = CheckedCounter(desired);
+    uint64_t word = word_of(counter);
+    if (counter) {
+      prepay(counter, kPrepaid - 1);
+      desired.reset_ptr_counter();
+      desired.reset_ptr();
+    }
+    return word;
+  }
+
+  // Drops the references of word that nobody has claimed.
+  static void release_word(uint64_t word) {
+    if (BasePtrCounter* counter = counter_of(word)) {
+      counter->release_shared_by(kPrepaid - claimed_of(word));
+    }
+  }
+
+  void refill(BasePtrCounter* counter) const;
+
+  bool compare_exchange(SharedPtr<T, Policy>& expected,
+                        SharedPtr<T, Policy>& desired, bool weak);
+
+  mutable std::atomic<uint64_t> word_;
+};
+
+template <typename T, typename Policy>
+SharedPtr<T, Policy> AtomicSharedPtr<T, Policy>::load() const {
+  uint64_t word = word_.fetch_add(kCountOne, std::memory_order_acquire);
+  BasePtrCounter* counter = counter_of(word);
+  if (!counter) {
+    return SharedPtr<T, Policy>();
+  }
+  if (claimed_of(word) == kPrepaid / 2) {
+    refill(counter);
+  }
+  return SharedPtr<T, Policy>(typename SharedPtr<T, Policy>::AdoptRef(),
+                              counter);
+}
+
+// The caller holds a reference, so counter stays alive throughout. If the
+// slot no longer holds counter with enough claims, the block was replaced
+// and its replacer took the claims into account; the references just
+// bought are dropped again.
+template <typename T, typename Policy>
+void AtomicSharedPtr<T, Policy>::refill(BasePtrCounter* counter) const {
+  constexpr uint32_t kRefill = kPrepaid / 2;
+  counter->increment_shared_count_by(kRefill);
+  uint64_t word = word_.load(std::memory_order_relaxed);
+  while (counter_of(word) == counter && claimed_of(word) >= kRefill) {
+    if (word_.compare_exchange_weak(word, word - kRefill * kCountOne,
+                                    std::memory_order_relaxed,
+                                    std::memory_order_relaxed)) {
+      return;
+    }
+  }
+  counter->release_shared_by(kRefill);
+}
+
+template <typename T, typename Policy>
+SharedPtr<T, Policy> AtomicSharedPtr<T, Policy>::exchange(
+    SharedPtr<T, Policy> desired) {
+  uint64_t word =
+      word_.exchange(adopt(std::move(desired)), std::memory_order_acq_rel);
+  BasePtrCounter* counter = counter_of(word);
+  if (!counter) {
+    return SharedPtr<T, Policy>();
+  }
+  uint32_t unclaimed = kPrepaid - claimed_of(word);
+  if (unclaimed > 1) {
+    counter->release_shared_by(unclaimed - 1);
+  }
+  return SharedPtr<T, Policy>(typename SharedPtr<T, Policy>::AdoptRef(),
+                              counter);
+}
+
+template <typename T, typename Policy>
+bool AtomicSharedPtr<T, Policy>::compare_exchange(
+    SharedPtr<T, Policy>& expected, SharedPtr<T, Policy>& desired,
+    bool weak) {
+  BasePtrCounter* expected_counter = CheckedCounter(expected);
+  BasePtrCounter* desired_counter = CheckedCounter(desired);
+  uint64_t desired_word = word_of(desired_counter);
+  uint64_t word = word_.load(std::memory_order_relaxed);
+  if (counter_of(word) == expected_counter) {
+    if (desired_counter) {
+      prepay(desired_counter, kPrepaid);
+    }
+    do {
+      if (word_.compare_exchange_weak(word, desired_word,
+                                      std::memory_order_acq_rel,
+                                      std::memory_order_relaxed)) {
+        release_word(word);
+        return true;
+      }
+    } while (!weak && counter_of(word) == expected_counter);
+    if (desired_counter) {
+      desired_counter->release_shared_by(kPrepaid);
+    }
+  }
+  expected = load();
+  return false;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Lock-free intrusive stack that any thread pushes onto and whose consumer
+// takes every node at once in one exchange. Nodes are never popped one by
+// one, so the stack is free of ABA. Next is the member linking the nodes.
+template <typename Node, Node* Node::*Next>
+class PushStack {
+ public:
+  void push(Node* node) {
+    node->*Next = head_.load(std::memory_order_relaxed);
+    while (!head_.compare_exchange_weak(node->*Next, node,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+    }
+  }
+
+  // The nodes pushed so far, most recent first.
+  Node* take_all() {
+    return head_.exchange(nullptr, std::memory_order_acquire);
+  }
+
+ private:
+  std::atomic<Node*> head_{nullptr};
+};
+
+// Background thread that runs a task every interval, or sooner when woken,
+// until stopped.
+class PeriodicWorker {
+ public:
+  PeriodicWorker() = default;
+
+  PeriodicWorker(const PeriodicWorker&) = delete;
+
+  PeriodicWorker& operator=(const PeriodicWorker&) = delete;
+
+  // Does nothing if the worker is already running.
+  void start(std::chrono::milliseconds interval, std::function<void()> task);
+
+  // Returns once the task has stopped running. Does nothing if the worker
+  // is not running.
+  void stop();
+
+  // Runs the task now rather than at the end of the interval.
+  void wake() { wake_.notify_one(); }
+
+  ~PeriodicWorker() { stop(); }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::thread thread_;
+  bool stopping_ = false;
+};
+
+inline void PeriodicWorker::start(std::chrono::milliseconds interval,
+                                  std::function<void()> task) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (thread_.joinable()) {
+    return;
+  }
+  stopping_ = false;
+  thread_ = std::thread([this, interval, task = std::move(task)] {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      wake_.wait_for(lock, interval);
+      if (stopping_) {
+        break;
+      }
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  });
+}
+
+inline void PeriodicWorker::stop() {
+  std::thread thread;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    thread.swap(thread_);
+  }
+  wake_.notify_all();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+// Per-thread records that other threads scan without a lock, such as
+// hazard pointers and reader epochs. The list only grows: a thread claims
+// a record whose active flag is clear, or prepends a new one, and hands it
+// back by clearing the flag. Records are never freed, only reused, so a
+// scan may run at any time. Record needs an std::atomic<bool> active and a
+// Record* next.
+template <typename Record>
+class RecordRegistry {
+ public:
+  Record* acquire() {
+    for (Record* record = head(); record; record = record->next) {
+      bool active = false;
+      if (!record->active.load(std::memory_order_relaxed) &&
+          record->active.compare_exchange_strong(active, true,
+                                                 std::memory_order_acquire)) {
+        return record;
+      }
+    }
+    Record* record = new Record;
+    record->active.store(true, std::memory_order_relaxed);
+    record->next = records_.load(std::memory_order_relaxed);
+    while (!records_.compare_exchange_weak(record->next, record,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+    }
+    return record;
+  }
+
+  static void release(Record* record) {
+    record->active.store(false, std::memory_order_release);
+  }
+
+  // The first record, for scans; follow next from there.
+  Record* head() const { return records_.load(std::memory_order_acquire); }
+
+ private:
+  std::atomic<Record*> records_{nullptr};
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "concurrency.hpp"
+#include "smart_pointers.hpp"
+
+// Hazard pointers for SharedPtrs published through ProtectedSharedPtr. A
+// reader announces the control block it is about to use in a hazard record
+// of its own and checks that the block is still published; a writer that
+// replaces the block retires the slot's reference instead of dropping it,
+// and retired references are dropped only once no record names their
+// block. Reading writes to nothing but the reader's own cache line.
+class HazardDomain {
+ public:
+  struct alignas(kCacheLineSize) Record {
+    std::atomic<const void*> hazard{nullptr};
+    std::atomic<bool> active{false};
+    Record* next = nullptr;
+  };
+
+  static HazardDomain& instance() {
+    static HazardDomain* domain = new HazardDomain;
+    return *domain;
+  }
+
+  // Records are cached per thread; they go back to the domain when the
+  // thread exits.
+  Record* acquire_record() {
+    if (ThreadRecords* records = thread_records()) {
+      if (!records->free.empty()) {
+        Record* record = records->free.back();
+        records->free.pop_back();
+        return record;
+      }
+    }
+    return records_.acquire();
+  }
+
+  void release_record(Record* record) {
+    record->hazard.store(nullptr, std::memory_order_release);
+    if (ThreadRecords* records = thread_records()) {
+      records->free.push_back(record);
+    } else {
+      RecordRegistry<Record>::release(record);
+    }
+  }
+
+  // Calls release(counter) right away if no hazard names counter, and
+  // otherwise once none does: every later retire() retries the references
+  // still pending, so a value outlives its last guard by at most one store.
+  void retire(const void* counter, void (*release)(const void*)) {
+    bool pending = pending_.load(std::memory_order_relaxed) != 0;
+    if (guarded(counter)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      retired_.push_back(Retired{counter, release});
+      pending_.store(retired_.size(), std::memory_order_relaxed);
+    } else {
+      release(counter);
+    }
+    if (pending) {
+      reclaim();
+    }
+  }
+
+  // Drops the retired references that no hazard names. Returns how many.
+  size_t reclaim();
+
+ private:
+  struct Retired {
+    const void* counter;
+    void (*release)(const void*);
+  };
+
+  struct ThreadRecords {
+    ~ThreadRecords() {
+      exited_ = true;
+      for (Record* record : free) {
+        RecordRegistry<Record>::release(record);
+      }
+    }
+
+    std::vector<Record*> free;
+  };
+
+  HazardDomain() = default;
+
+  // The caller has already unpublished counter, so a reader that announces
+  // it afterwards finds it replaced and tries again.
+  bool guarded(const void* counter) const {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (Record* record = records_.head(); record; record = record->next) {
+      if (record->hazard.load(std::memory_order_seq_cst) == counter) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static ThreadRecords* thread_records() {
+    if (exited_) {
+      return nullptr;
+    }
+    thread_local ThreadRecords records;
+    return &records;
+  }
+
+  static inline thread_local bool exited_ = false;
+
+  RecordRegistry<Record> records_;
+
+  std::mutex mutex_;
+  std::vector<Retired> retired_;
+  // retired_.size(), readable without the lock.
+  std::atomic<size_t> pending_{0};
+};
+
+// Releasing runs destructors, which may retire more, so the lock is not
+// held meanwhile.
+inline size_t HazardDomain::reclaim() {
+  std::vector<Retired> retired;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired.swap(retired_);
+    pending_.store(0, std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  std::vector<const void*> hazards;
+  for (Record* record = records_.head(); record; record = record->next) {
+    if (const void* hazard = record->hazard.load(std::memory_order_seq_cst)) {
+      hazards.push_back(hazard);
+    }
+  }
+  std::sort(hazards.begin(), hazards.end());
+  std::vector<Retired> kept;
+  size_t released = 0;
+  for (const Retired& entry : retired) {
+    if (std::binary_search(hazards.begin(), hazards.end(), entry.counter)) {
+      kept.push_back(entry);
+    } else {
+      entry.release(entry.counter);
+      ++released;
+    }
+  }
+  if (!kept.empty()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired_.insert(retired_.end(), kept.begin(), kept.end());
+    pending_.store(retired_.size(), std::memory_order_relaxed);
+  }
+  return released;
+}
+
+template <typename T, typename Policy>
+class ProtectedSharedPtr;
+
+// Non-owning view of the object a ProtectedSharedPtr held when guard() was
+// called. The object stays alive until the view is reset or destroyed,
+// without any change to its counts.
+template <typename T, typename Policy = MultiThreadPolicy>
+class Guarded {
+ public:
+  using element_type = typename SharedPtr<T, Policy>::element_type;
+
+  Guarded(const Guarded&) = delete;
+
+  Guarded& operator=(const Guarded&) = delete;
+
+  Guarded(Guarded&& other_ptr)
+      : record_(other_ptr.record_),
+        counter_(other_ptr.counter_),
+        ptr_(other_ptr.ptr_) {
+    other_ptr.record_ = nullptr;
+    other_ptr.counter_ = nullptr;
+    other_ptr.ptr_ = nullptr;
+  }
+
+  Guarded& operator=(Guarded&& other_ptr) {
+    if (this != &other_ptr) {
+      reset();
+      std::swap(record_, other_ptr.record_);
+      std::swap(counter_, other_ptr.counter_);
+      std::swap(ptr_, other_ptr.ptr_);
+    }
+    return *this;
+  }
+
+  element_type* get() const { return ptr_; }
+
+  element_type& operator*() const { return *ptr_; }
+
+  element_type* operator->() const { return ptr_; }
+
+  // Takes a shared reference, for keeping the object past the view.
+  SharedPtr<T, Policy> to_shared() const {
+    return SharedPtr<T, Policy>(counter_);
+  }
+
+  void reset() {
+    if (record_) {
+      HazardDomain::instance().release_record(record_);
+      record_ = nullptr;
+      counter_ = nullptr;
+      ptr_ = nullptr;
+    }
+  }
+
+  ~Guarded() { reset(); }
+
+ private:
+  friend class ProtectedSharedPtr<T, Policy>;
+
+  using BasePtrCounter = typename SharedPtr<T, Policy>::BasePtrCounter;
+
+  Guarded(HazardDomain::Record* record, BasePtrCounter* counter)
+      : record_(record),
+        counter_(counter),
+        ptr_(counter ? static_cast<element_type*>(counter->get_ptr())
+                     : nullptr) {}
+
+  HazardDomain::Record* record_;
+  BasePtrCounter* counter_;
+  element_type* ptr_;
+};
+
+// A published SharedPtr that readers access through guard(), paying for a
+// hazard record of their own instead of a shared count update. A replaced
+// value is released at once unless a guard names it, and otherwise retired
+// to HazardDomain until none does. Only the control block is stored, so
+// aliased SharedPtrs throw std::invalid_argument.
+template <typename T, typename Policy = MultiThreadPolicy>
+class ProtectedSharedPtr {
+ public:
+  ProtectedSharedPtr() : counter_(nullptr) {}
+
+  explicit ProtectedSharedPtr(SharedPtr<T, Policy> desired)
+      : counter_(adopt(std::move(desired))) {}
+
+  ProtectedSharedPtr(const ProtectedSharedPtr&) = delete;
+
+  ProtectedSharedPtr& operator=(const ProtectedSharedPtr&) = delete;
+
+  Guarded<T, Policy> guard() const;
+
+  SharedPtr<T, Policy> load() const { return guard().to_shared(); }
+
+  void store(SharedPtr<T, Policy> desired) {
+    retire(counter_.exchange(adopt(std::move(desired)),
+                             std::memory_order_seq_cst));
+  }
+
+  ~ProtectedSharedPtr() { retire(counter_.load(std::memory_order_relaxed)); }
+
+ private:
+  using BasePtrCounter = typename SharedPtr<T, Policy>::BasePtrCounter;
+
+  static BasePtrCounter* adopt(SharedPtr<T, Policy> desired) {
+    BasePtrCounter* counter = CheckedCounter(desired);
+    desired.reset_ptr_counter();
+    desired.reset_ptr();
+    return counter;
+  }
+
+  static void retire(BasePtrCounter* counter) {
+    if (counter) {
+      HazardDomain::instance().retire(counter, [](const void* retired) {
+        static_cast<BasePtrCounter*>(const_cast<void*>(retired))
+            ->release_shared();
+      });
+    }
+  }
+
+  std::atomic<BasePtrCounter*> counter_;
+};
+
+template <typename T, typename Policy>
+Guarded<T, Policy> ProtectedSharedPtr<T, Policy>::guard() const {
+  HazardDomain::Record* record = HazardDomain::instance().acquire_record();
+  BasePtrCounter* counter = counter_.load(std::memory_order_relaxed);
+  while (true) {
+    record->hazard.store(counter, std::memory_order_seq_cst);
+    BasePtrCounter* current = counter_.load(std::memory_order_seq_cst);
+    if (current == counter) {
+      return Guarded<T, Policy>(record, counter);
+    }
+    counter = current;
+  }
+}
@@ -0,0 +1,372 @@
+#pragma once
+
+#include "smart_pointers.hpp"
+
+// Base for types that embed their own shared count, so that
+// IntrusiveSharedPtr is a single pointer and nothing else is allocated.
+// Derived is the most derived type that gets deleted on the last release.
+template <typename Derived, typename Policy = MultiThreadPolicy>
+class RefCounted {
+ public:
+  void add_ref() const { count_.fetch_add(1, std::memory_order_relaxed); }
+
+  void release_ref() const {
+    if (drop_ref()) {
+      delete static_cast<const Derived*>(this);
+    }
+  }
+
+  uint32_t use_count() const {
+    return count_.load(std::memory_order_acquire);
+  }
+
+ protected:
+  RefCounted() = default;
+
+  // A copy of an object is not owned by the owners of the original.
+  RefCounted(const RefCounted&) {}
+
+  RefCounted& operator=(const RefCounted&) { return *this; }
+
+  ~RefCounted() = default;
+
+  bool try_add_ref() const {
+    uint32_t count = count_.load(std::memory_order_relaxed);
+    while (count != 0) {
+      if (count_.compare_exchange_weak(count, count + 1,
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns true if the released reference was the last one.
+  bool drop_ref() const {
+    return count_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+ private:
+  mutable typename Policy::Counter count_{0};
+};
+
+// RefCounted with IntrusiveWeakPtr support. The weak side lives in a small
+// companion block allocated on the first IntrusiveWeakPtr, so objects that
+// are never observed weakly only pay for one pointer.
+template <typename Derived, typename Policy = MultiThreadPolicy>
+class WeakRefCounted : public RefCounted<Derived, Policy> {
+ public:
+  class WeakCompanion {
+   public:
+    explicit WeakCompanion(const WeakRefCounted* object) : object_(object) {}
+
+    void add_ref() { ref_count_.fetch_add(1, std::memory_order_relaxed); }
+
+    void release_ref() {
+      if (ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+      }
+    }
+
+    // Returns the object with a reference already added on it, or nullptr
+    // if it is gone.
+    Derived* lock() {
+      std::lock_guard<SpinLock> guard(lock_);
+      if (!object_ || !object_->try_add_ref()) {
+        return nullptr;
+      }
+      return const_cast<Derived*>(static_cast<const Derived*>(object_));
+    }
+
+    bool expired() {
+      std::lock_guard<SpinLock> guard(lock_);
+      return !object_ || object_->use_count() == 0;
+    }
+
+   private:
+    friend class WeakRefCounted;
+
+    // The object is only touched under the lock, and its last release
+    // clears object_ under the same lock before deleting it.
+    class SpinLock {
+     public:
+      void lock() {
+        while (flag_.test_and_set(std::memory_order_acquire)) {
+        }
+      }
+
+      void unlock() { flag_.clear(std::memory_order_release); }
+
+     private:
+      std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+    };
+
+    void detach() {
+      std::lock_guard<SpinLock> guard(lock_);
+      object_ = nullptr;
+    }
+
+    typename Policy::Counter ref_count_{1};
+    SpinLock lock_;
+    const WeakRefCounted* object_;
+  };
+
+  void release_ref() const {
+    if (!this->drop_ref()) {
+      return;
+    }
+    if (WeakCompanion* companion =
+            companion_.load(std::memory_order_acquire)) {
+      companion->detach();
+      companion->release_ref();
+    }
+    delete static_cast<const Derived*>(this);
+  }
+
+  // Returns the companion with a reference added for the caller.
+  WeakCompanion* weak_companion() const {
+    WeakCompanion* companion = companion_.load(std::memory_order_acquire);
+    if (!companion) {
+      WeakCompanion* created = new WeakCompanion(this);
+      if (companion_.compare_exchange_strong(companion, created,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_acquire)) {
+        companion = created;
+      } else {
+        delete created;
+      }
+    }
+    companion->add_ref();
+    return companion;
+  }
+
+ protected:
+  WeakRefCounted() = default;
+
+  WeakRefCounted(const WeakRefCounted& other)
+      : RefCounted<Derived, Policy>(other) {}
+
+  WeakRefCounted& operator=(const WeakRefCounted&) { return *this; }
+
+  ~WeakRefCounted() = default;
+
+ private:
+  mutable std::atomic<WeakCompanion*> companion_{nullptr};
+};
+
+template <typename T>
+class IntrusiveSharedPtr {
+ public:
+  IntrusiveSharedPtr();
+
+  IntrusiveSharedPtr(T* ptr, bool add_ref = true);
+
+  IntrusiveSharedPtr(const IntrusiveSharedPtr& other_ptr);
+
+  IntrusiveSharedPtr(IntrusiveSharedPtr&& other_ptr);
+
+  template <typename Y>
+  IntrusiveSharedPtr(const IntrusiveSharedPtr<Y>& other_ptr);
+
+  template <typename Y>
+  IntrusiveSharedPtr(IntrusiveSharedPtr<Y>&& other_ptr);
+
+  const IntrusiveSharedPtr& operator=(const IntrusiveSharedPtr& other_ptr);
+
+  const IntrusiveSharedPtr& operator=(IntrusiveSharedPtr&& other_ptr);
+
+  template <typename Y>
+  const IntrusiveSharedPtr& operator=(const IntrusiveSharedPtr<Y>& other_ptr);
+
+  T* get() const { return ptr_; }
+
+  T& operator*() const { return *ptr_; }
+
+  T* operator->() const { return ptr_; }
+
+  uint32_t use_count() const;
+
+  void reset();
+
+  // Gives up ownership without releasing the reference.
+  T* detach();
+
+  ~IntrusiveSharedPtr();
+
+ private:
+  T* ptr_;
+};
+
+template <typename T>
+IntrusiveSharedPtr<T>::IntrusiveSharedPtr() : ptr_(nullptr) {}
+
+template <typename T>
+IntrusiveSharedPtr<T>::IntrusiveSharedPtr(T* ptr, bool add_ref) : ptr_(ptr) {
+  if (ptr_ && add_ref) {
+    ptr_->add_ref();
+  }
+}
+
+template <typename T>
+IntrusiveSharedPtr<T>::IntrusiveSharedPtr(const IntrusiveSharedPtr& other_ptr)
+    : IntrusiveSharedPtr(other_ptr.get()) {}
+
+template <typename T>
+IntrusiveSharedPtr<T>::IntrusiveSharedPtr(IntrusiveSharedPtr&& other_ptr)
+    : ptr_(other_ptr.detach()) {}
+
+template <typename T>
+template <typename Y>
+IntrusiveSharedPtr<T>::IntrusiveSharedPtr(
+    const IntrusiveSharedPtr<Y>& other_ptr)
+    : IntrusiveSharedPtr(other_ptr.get()) {}
+
+template <typename T>
+template <typename Y>
+IntrusiveSharedPtr<T>::IntrusiveSharedPtr(IntrusiveSharedPtr<Y>&& other_ptr)
+    : ptr_(other_ptr.detach()) {}
+
+template <typename T>
+const IntrusiveSharedPtr<T>& IntrusiveSharedPtr<T>::operator=(
+    const IntrusiveSharedPtr& other_ptr) {
+  return *this = IntrusiveSharedPtr<T>(other_ptr);
+}
+
+template <typename T>
+const IntrusiveSharedPtr<T>& IntrusiveSharedPtr<T>::operator=(
+    IntrusiveSharedPtr&& other_ptr) {
+  if (this != &other_ptr) {
+    T* old_ptr = ptr_;
+    ptr_ = other_ptr.detach();
+    if (old_ptr) {
+      old_ptr->release_ref();
+    }
+  }
+  return *this;
+}
+
+template <typename T>
+template <typename Y>
+const IntrusiveSharedPtr<T>& IntrusiveSharedPtr<T>::operator=(
+    const IntrusiveSharedPtr<Y>& other_ptr) {
+  return *this = IntrusiveSharedPtr<T>(other_ptr);
+}
+
+template <typename T>
+uint32_t IntrusiveSharedPtr<T>::use_count() const {
+  return ptr_ ? ptr_->use_count() : 0;
+}
+
+template <typename T>
+void IntrusiveSharedPtr<T>::reset() {
+  *this = IntrusiveSharedPtr<T>();
+}
+
+template <typename T>
+T* IntrusiveSharedPtr<T>::detach() {
+  T* ptr = ptr_;
+  ptr_ = nullptr;
+  return ptr;
+}
+
+template <typename T>
+IntrusiveSharedPtr<T>::~IntrusiveSharedPtr() {
+  if (ptr_) {
+    ptr_->release_ref();
+  }
+}
+
+template <typename T>
+class IntrusiveWeakPtr {
+ public:
+  using WeakCompanion = typename T::WeakCompanion;
+
+  IntrusiveWeakPtr();
+
+  IntrusiveWeakPtr(const IntrusiveSharedPtr<T>& other_ptr);
+
+  IntrusiveWeakPtr(const IntrusiveWeakPtr& other_ptr);
+
+  IntrusiveWeakPtr(IntrusiveWeakPtr&& other_ptr);
+
+  const IntrusiveWeakPtr& operator=(const IntrusiveWeakPtr& other_ptr);
+
+  const IntrusiveWeakPtr& operator=(IntrusiveWeakPtr&& other_ptr);
+
+  bool expired() const;
+
+  // Throws if the object is already gone, like WeakPtr::lock.
+  IntrusiveSharedPtr<T> lock() const;
+
+  ~IntrusiveWeakPtr();
+
+ private:
+  WeakCompanion* companion_;
+};
+
+template <typename T>
+IntrusiveWeakPtr<T>::IntrusiveWeakPtr() : companion_(nullptr) {}
+
+template <typename T>
+IntrusiveWeakPtr<T>::IntrusiveWeakPtr(const IntrusiveSharedPtr<T>& other_ptr)
+    : companion_(other_ptr.get() ? other_ptr->weak_companion() : nullptr) {}
+
+template <typename T>
+IntrusiveWeakPtr<T>::IntrusiveWeakPtr(const IntrusiveWeakPtr& other_ptr)
+    : companion_(other_ptr.companion_) {
+  if (companion_) {
+    companion_->add_ref();
+  }
+}
+
+template <typename T>
+IntrusiveWeakPtr<T>::IntrusiveWeakPtr(IntrusiveWeakPtr&& other_ptr)
+    : companion_(other_ptr.companion_) {
+  other_ptr.companion_ = nullptr;
+}
+
+template <typename T>
+const IntrusiveWeakPtr<T>& IntrusiveWeakPtr<T>::operator=(
+    const IntrusiveWeakPtr& other_ptr) {
+  return *this = IntrusiveWeakPtr<T>(other_ptr);
+}
+
+template <typename T>
+const IntrusiveWeakPtr<T>& IntrusiveWeakPtr<T>::operator=(
+    IntrusiveWeakPtr&& other_ptr) {
+  if (this != &other_ptr) {
+    if (companion_) {
+      companion_->release_ref();
+    }
+    companion_ = other_ptr.companion_;
+    other_ptr.companion_ = nullptr;
+  }
+  return *this;
+}
+
+template <typename T>
+bool IntrusiveWeakPtr<T>::expired() const {
+  return !companion_ || companion_->expired();
+}
+
+template <typename T>
+IntrusiveSharedPtr<T> IntrusiveWeakPtr<T>::lock() const {
+  T* ptr = companion_ ? static_cast<T*>(companion_->lock()) : nullptr;
+  if (!ptr) {
+    throw std::runtime_error("Попытка обратиться по устарелой ссылке");
+  }
+  return IntrusiveSharedPtr<T>(ptr, false);
+}
+
+template <typename T>
+IntrusiveWeakPtr<T>::~IntrusiveWeakPtr() {
+  if (companion_) {
+    companion_->release_ref();
+  }
+}
+
+template <typename T, typename... Args>
+IntrusiveSharedPtr<T> MakeIntrusive(Args&&... args) {
+  return IntrusiveSharedPtr<T>(new T(std::forward<Args>(args)...));
+}
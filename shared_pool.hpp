@@ -0,0 +1,361 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include "concurrency.hpp"
+#include "smart_pointers.hpp"
+
+// Hands out SharedPtr<T>s whose objects are recycled instead of destroyed:
+// once the last SharedPtr is gone, the object, still constructed, goes
+// through the reset hook and back to the thread that first built it, whose
+// next acquire returns it as is. As in SlabPool, every thread keeps a free
+// list only it touches plus a lock-free list that other threads push onto
+// and that the owner takes over in one exchange; each holds up to
+// max_cached objects and anything beyond is destroyed. Caches of exited
+// threads go to the next thread that uses the pool. The pool must outlive
+// the SharedPtrs it hands out, and the reset hook must not throw.
+template <typename T, typename Policy = MultiThreadPolicy>
+class SharedPool {
+ public:
+  using Reset = std::function<void(T&)>;
+
+  struct Stats {
+    // Acquires served from a free list, and ones that built a new object.
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Releases that kept the object, and ones that destroyed it because
+    // the free list was full.
+    uint64_t recycled = 0;
+    uint64_t discarded = 0;
+  };
+
+  explicit SharedPool(size_t max_cached = 64, Reset reset = Reset());
+
+  SharedPool(const SharedPool&) = delete;
+
+  SharedPool& operator=(const SharedPool&) = delete;
+
+  // args build the object only when the calling thread has none cached.
+  template <typename... Args>
+  SharedPtr<T, Policy> acquire(Args&&... args);
+
+  Stats stats() const;
+
+  ~SharedPool();
+
+ private:
+  static_assert(!std::is_array_v<T>, "SharedPool holds single objects");
+
+  using BasePtrCounter = typename SharedPtr<T, Policy>::BasePtrCounter;
+
+  struct Slot;
+
+  // Rebuilt in the slot on every acquire; the object next to it is not.
+  class Counter : public BasePtrCounter {
+   public:
+    explicit Counter(Slot* slot)
+        : BasePtrCounter(&BasePtrCounter::template OpsFor<Counter>::kOps),
+          slot_(slot) {}
+
+    T* get_ptr() const { return &slot_->object; }
+
+    void destroy() {
+      SharedPtr<T, Policy>::unlink_shared_from_this(&slot_->object);
+      SharedPool* pool = slot_->owner->pool;
+      if (pool->reset_) {
+        pool->reset_(slot_->object);
+      }
+    }
+
+    void deallocate() {
+      Slot* slot = slot_;
+      this->~Counter();
+      slot->owner->pool->recycle(slot);
+    }
+
+   private:
+    Slot* slot_;
+  };
+
+  class Cache;
+
+  struct Slot {
+    Slot() {}
+
+    ~Slot() {}
+
+    Slot* next = nullptr;
+    Cache* owner = nullptr;
+    union {
+      Counter counter;
+    };
+    union {
+      T object;
+    };
+  };
+
+  class Cache {
+   public:
+    explicit Cache(SharedPool* owner_pool) : pool(owner_pool) {}
+
+    Slot* pop() {
+      if (!free_list_) {
+        take_remote();
+      }
+      Slot* slot = free_list_;
+      if (slot) {
+        free_list_ = slot->next;
+        --size_;
+      }
+      return slot;
+    }
+
+    bool push_local(Slot* slot) {
+      if (size_ >= pool->max_cached_) {
+        return false;
+      }
+      slot->next = free_list_;
+      free_list_ = slot;
+      ++size_;
+      return true;
+    }
+
+    bool push_remote(Slot* slot) {
+      if (remote_size_.fetch_add(1, std::memory_order_relaxed) >=
+          pool->max_cached_) {
+        remote_size_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+      }
+      remote_list_.push(slot);
+      return true;
+    }
+
+    void discard_all() {
+      while (Slot* slot = pop()) {
+        discard(slot);
+      }
+    }
+
+    // Owner-only counters are bumped without a read-modify-write.
+    static void bump(std::atomic<uint64_t>& stat) {
+      stat.store(stat.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+    }
+
+    SharedPool* const pool;
+    bool orphaned = false;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> recycled{0};
+    std::atomic<uint64_t> discarded{0};
+
+   private:
+    void take_remote() {
+      Slot* list = remote_list_.take_all();
+      size_t count = 0;
+      for (Slot* slot = list; slot; slot = slot->next) {
+        ++count;
+      }
+      remote_size_.fetch_sub(count, std::memory_order_relaxed);
+      free_list_ = list;
+      size_ = count;
+    }
+
+    Slot* free_list_ = nullptr;
+    size_t size_ = 0;
+    PushStack<Slot, &Slot::next> remote_list_;
+    std::atomic<size_t> remote_size_{0};
+  };
+
+  struct ThreadEntry {
+    uint64_t pool_id = 0;
+    Cache* cache = nullptr;
+  };
+
+  // Caches the calling thread owns, one per pool it has used.
+  struct ThreadCaches {
+    ~ThreadCaches() {
+      exited_ = true;
+      last_entry_ = ThreadEntry();
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      for (const ThreadEntry& entry : entries) {
+        if (live_pools().count(entry.pool_id)) {
+          entry.cache->orphaned = true;
+        }
+      }
+    }
+
+    std::vector<ThreadEntry> entries;
+  };
+
+  static ThreadCaches& thread_caches() {
+    thread_local ThreadCaches caches;
+    return caches;
+  }
+
+  // The calling thread's cache for this pool, registered on first use if
+  // create is set. Null once the thread is past its caches' destruction.
+  Cache* local_cache(bool create);
+
+  Cache* adopt_cache();
+
+  void recycle(Slot* slot);
+
+  static void discard(Slot* slot) {
+    slot->object.~T();
+    delete slot;
+  }
+
+  static std::mutex& registry_mutex() {
+    static std::mutex* mutex = new std::mutex;
+    return *mutex;
+  }
+
+  // Ids of the pools alive, so that exiting threads skip caches of pools
+  // already destroyed. Ids are never reused.
+  static std::unordered_set<uint64_t>& live_pools() {
+    static std::unordered_set<uint64_t>* pools =
+        new std::unordered_set<uint64_t>;
+    return *pools;
+  }
+
+  static inline uint64_t next_id_ = 0;
+  static inline thread_local ThreadEntry last_entry_;
+  static inline thread_local bool exited_ = false;
+
+  const size_t max_cached_;
+  const Reset reset_;
+  uint64_t id_;
+  std::vector<Cache*> caches_;
+};
+
+template <typename T, typename Policy>
+SharedPool<T, Policy>::SharedPool(size_t max_cached, Reset reset)
+    : max_cached_(max_cached), reset_(std::move(reset)) {
+  std::lock_guard<std::mutex> lock(registry_mutex());
+  id_ = ++next_id_;
+  live_pools().insert(id_);
+}
+
+template <typename T, typename Policy>
+template <typename... Args>
+SharedPtr<T, Policy> SharedPool<T, Policy>::acquire(Args&&... args) {
+  Cache* cache = local_cache(true);
+  if (!cache) {
+    return MakeShared<T, Policy>(std::forward<Args>(args)...);
+  }
+  Slot* slot = cache->pop();
+  if (slot) {
+    Cache::bump(cache->hits);
+  } else {
+    slot = new Slot;
+    try {
+      ::new (static_cast<void*>(&slot->object))
+          T(std::forward<Args>(args)...);
+    } catch (...) {
+      delete slot;
+      throw;
+    }
+    slot->owner = cache;
+    Cache::bump(cache->misses);
+  }
+  Counter* counter = ::new (static_cast<void*>(&slot->counter)) Counter(slot);
+  SharedPtr<T, Policy> result(typename SharedPtr<T, Policy>::AdoptRef(),
+                              static_cast<BasePtrCounter*>(counter));
+  result.link_shared_from_this(&slot->object);
+  return result;
+}
+
+template <typename T, typename Policy>
+typename SharedPool<T, Policy>::Stats SharedPool<T, Policy>::stats() const {
+  Stats stats;
+  std::lock_guard<std::mutex> lock(registry_mutex());
+  for (const Cache* cache : caches_) {
+    stats.hits += cache->hits.load(std::memory_order_relaxed);
+    stats.misses += cache->misses.load(std::memory_order_relaxed);
+    stats.recycled += cache->recycled.load(std::memory_order_relaxed);
+    stats.discarded += cache->discarded.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+template <typename T, typename Policy>
+SharedPool<T, Policy>::~SharedPool() {
+  std::lock_guard<std::mutex> lock(registry_mutex());
+  live_pools().erase(id_);
+  for (Cache* cache : caches_) {
+    cache->discard_all();
+    delete cache;
+  }
+}
+
+template <typename T, typename Policy>
+typename SharedPool<T, Policy>::Cache* SharedPool<T, Policy>::local_cache(
+    bool create) {
+  if (last_entry_.pool_id == id_) {
+    return last_entry_.cache;
+  }
+  if (exited_) {
+    return nullptr;
+  }
+  ThreadCaches& caches = thread_caches();
+  Cache* cache = nullptr;
+  for (const ThreadEntry& entry : caches.entries) {
+    if (entry.pool_id == id_) {
+      cache = entry.cache;
+    }
+  }
+  if (!cache) {
+    if (!create) {
+      return nullptr;
+    }
+    cache = adopt_cache();
+  }
+  last_entry_ = ThreadEntry{id_, cache};
+  return cache;
+}
+
+template <typename T, typename Policy>
+typename SharedPool<T, Policy>::Cache* SharedPool<T, Policy>::adopt_cache() {
+  std::vector<ThreadEntry>& entries = thread_caches().entries;
+  std::lock_guard<std::mutex> lock(registry_mutex());
+  entries.erase(std::remove_if(entries.begin(), entries.end(),
+                               [](const ThreadEntry& entry) {
+                                 return !live_pools().count(entry.pool_id);
+                               }),
+                entries.end());
+  Cache* cache = nullptr;
+  for (Cache* candidate : caches_) {
+    if (candidate->orphaned) {
+      candidate->orphaned = false;
+      cache = candidate;
+      break;
+    }
+  }
+  if (!cache) {
+    cache = new Cache(this);
+    caches_.push_back(cache);
+  }
+  entries.push_back(ThreadEntry{id_, cache});
+  return cache;
+}
+
+template <typename T, typename Policy>
+void SharedPool<T, Policy>::recycle(Slot* slot) {
+  Cache* owner = slot->owner;
+  bool kept = owner == local_cache(false) ? owner->push_local(slot)
+                                          : owner->push_remote(slot);
+  if (kept) {
+    owner->recycled.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    owner->discarded.fetch_add(1, std::memory_order_relaxed);
+    discard(slot);
+  }
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "concurrency.hpp"
+
+// Size-class slab allocator for small, short-lived blocks such as
+// SharedPtr control blocks. Every thread carves blocks out of its own
+// 64 KiB slabs and keeps per-class free lists, so the common path takes no
+// lock and no atomic operation. A block freed by another thread is pushed
+// onto a lock-free list of the owning cache, which takes the whole list
+// back in one exchange when its local list runs dry. Caches of exited
+// threads are handed to the next new thread together with their slabs;
+// slab memory itself is never returned to the system.
+class SlabPool {
+ public:
+  static constexpr size_t kGranularity = 16;
+  static constexpr size_t kMaxBlockSize = 256;
+  static constexpr size_t kSlabSize = 64 * 1024;
+
+  static void* allocate(size_t size, size_t alignment) {
+    if (size > kMaxBlockSize || alignment > kGranularity) {
+      return ::operator new(size, std::align_val_t(alignment));
+    }
+    size_t size_class = class_of(size);
+    if (ThreadCache* cache = ThreadCache::current()) {
+      return cache->allocate(size_class);
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    return fallback_cache().allocate(size_class);
+  }
+
+  static void deallocate(void* ptr, size_t size, size_t alignment) {
+    if (size > kMaxBlockSize || alignment > kGranularity) {
+      ::operator delete(ptr, std::align_val_t(alignment));
+      return;
+    }
+    SlabHeader* slab = reinterpret_cast<SlabHeader*>(
+        reinterpret_cast<uintptr_t>(ptr) & ~(kSlabSize - 1));
+    if (slab->cache == ThreadCache::current()) {
+      slab->cache->free_local(ptr, slab->size_class);
+    } else {
+      slab->cache->free_remote(ptr, slab->size_class);
+    }
+  }
+
+ private:
+  static constexpr size_t kClassCount = kMaxBlockSize / kGranularity;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  class ThreadCache;
+
+  struct alignas(kGranularity) SlabHeader {
+    ThreadCache* cache;
+    size_t size_class;
+  };
+
+  class ThreadCache {
+   public:
+    static ThreadCache* current() {
+      if (!current_ && !exited_) {
+        thread_local ThreadHandle handle;
+        current_ = handle.cache;
+      }
+      return current_;
+    }
+
+    void* allocate(size_t size_class) {
+      SizeClass& sc = classes_[size_class];
+      if (!sc.free_list) {
+        sc.free_list = sc.remote_list.take_all();
+      }
+      if (FreeBlock* block = sc.free_list) {
+        sc.free_list = block->next;
+        return block;
+      }
+      size_t block_size = (size_class + 1) * kGranularity;
+      if (sc.bump + block_size > sc.bump_end) {
+        SlabHeader* slab = static_cast<SlabHeader*>(
+            ::operator new(kSlabSize, std::align_val_t(kSlabSize)));
+        slab->cache = this;
+        slab->size_class = size_class;
+        sc.bump = reinterpret_cast<char*>(slab + 1);
+        sc.bump_end = reinterpret_cast<char*>(slab) + kSlabSize;
+      }
+      void* block = sc.bump;
+      sc.bump += block_size;
+      return block;
+    }
+
+    void free_local(void* ptr, size_t size_class) {
+      FreeBlock* block = static_cast<FreeBlock*>(ptr);
+      block->next = classes_[size_class].free_list;
+      classes_[size_class].free_list = block;
+    }
+
+    void free_remote(void* ptr, size_t size_class) {
+      classes_[size_class].remote_list.push(static_cast<FreeBlock*>(ptr));
+    }
+
+   private:
+    struct SizeClass {
+      FreeBlock* free_list = nullptr;
+      char* bump = nullptr;
+      char* bump_end = nullptr;
+      PushStack<FreeBlock, &FreeBlock::next> remote_list;
+    };
+
+    struct ThreadHandle {
+      ThreadHandle() : cache(adopt()) {}
+
+      ~ThreadHandle() {
+        exited_ = true;
+        current_ = nullptr;
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        orphans().push_back(cache);
+      }
+
+      ThreadCache* cache;
+    };
+
+    static ThreadCache* adopt() {
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      if (orphans().empty()) {
+        return new ThreadCache;
+      }
+      ThreadCache* cache = orphans().back();
+      orphans().pop_back();
+      return cache;
+    }
+
+    static std::vector<ThreadCache*>& orphans() {
+      static std::vector<ThreadCache*>* orphans =
+          new std::vector<ThreadCache*>;
+      return *orphans;
+    }
+
+    static inline thread_local ThreadCache* current_ = nullptr;
+    static inline thread_local bool exited_ = false;
+
+    SizeClass classes_[kClassCount];
+  };
+
+  static size_t class_of(size_t size) {
+    return size == 0 ? 0 : (size - 1) / kGranularity;
+  }
+
+  // Serves threads that are past their cache's destruction at exit.
+  static ThreadCache& fallback_cache() {
+    static ThreadCache* cache = new ThreadCache;
+    return *cache;
+  }
+
+  static std::mutex& registry_mutex() {
+    static std::mutex* mutex = new std::mutex;
+    return *mutex;
+  }
+};
+
+template <typename U>
+class SlabAllocator {
+ public:
+  using value_type = U;
+
+  SlabAllocator() = default;
+
+  template <typename V>
+  SlabAllocator(const SlabAllocator<V>&) {}
+
+  U* allocate(size_t n) {
+    return static_cast<U*>(SlabPool::allocate(n * sizeof(U), alignof(U)));
+  }
+
+  void deallocate(U* ptr, size_t n) {
+    SlabPool::deallocate(ptr, n * sizeof(U), alignof(U));
+  }
+
+  template <typename V>
+  bool operator==(const SlabAllocator<V>&) const {
+    return true;
+  }
+
+  template <typename V>
+  bool operator!=(const SlabAllocator<V>&) const {
+    return false;
+  }
+};
@@ -1,205 +1,1353 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
 
-template <typename T>
-class SharedPtr {
+#include "concurrency.hpp"
+#include "slab_allocator.hpp"
+
+template <typename U>
+class NonAtomic {
  public:
-  class BasePtrCounter {
-   public:
-    virtual T* get_ptr() const = 0;
-    virtual void destroy() = 0;
-    virtual void deallocate() = 0;
+  NonAtomic(U value) : value_(value) {}
 
-    void increment_shared_count() { ++shared_count_; }
-    void decrement_shared_count() { --shared_count_; }
-    void increment_weak_count() { ++weak_count_; }
-    void decrement_weak_count() { --weak_count_; }
+  U load(std::memory_order = std::memory_order_seq_cst) const {
+    return value_;
+  }
 
-    uint32_t get_shared_count() const { return shared_count_; }
-    uint32_t get_weak_count() const { return weak_count_; }
+  U fetch_add(U arg, std::memory_order = std::memory_order_seq_cst) {
+    U old_value = value_;
+    value_ += arg;
+    return old_value;
+  }
 
-   private:
-    uint32_t shared_count_ = 0;
-    uint32_t weak_count_ = 0;
+  U fetch_sub(U arg, std::memory_order = std::memory_order_seq_cst) {
+    U old_value = value_;
+    value_ -= arg;
+    return old_value;
+  }
+
+  bool compare_exchange_weak(U& expected, U desired, std::memory_order,
+                             std::memory_order) {
+    if (value_ != expected) {
+      expected = value_;
+      return false;
+    }
+    value_ = desired;
+    return true;
+  }
+
+ private:
+  U value_;
+};
+
+// Holds a U, taking no space when U is an empty class (deleters, allocators).
+// Index tells apart two members of the same type.
+template <typename U, int Index = 0,
+          bool = std::is_empty_v<U> && !std::is_final_v<U>>
+class EboStorage {
+ public:
+  explicit EboStorage(U value) : value_(std::move(value)) {}
+
+  U& value() { return value_; }
+
+ private:
+  U value_;
+};
+
+template <typename U, int Index>
+class EboStorage<U, Index, true> : private U {
+ public:
+  explicit EboStorage(U value) : U(std::move(value)) {}
+
+  U& value() { return *this; }
+};
+
+constexpr size_t kCacheLineSize = 64;
+
+// Where MakeShared places the object relative to the counts in the same
+// allocation. PackedLayout puts it right after them. CacheLineLayout starts
+// it on a cache line of its own and rounds the allocation up to whole lines,
+// so reference counting by readers does not invalidate the lines writers of
+// the object are updating, at the cost of up to two lines of padding.
+struct PackedLayout {
+  static constexpr size_t kAlignment = 1;
+};
+
+struct CacheLineLayout {
+  static constexpr size_t kAlignment = kCacheLineSize;
+};
+
+// Allocation unit for a control block of type Counter followed by elements
+// of type Element, aligned for both and to at least MinAlignment.
+template <typename Counter, typename Element, size_t MinAlignment = 1>
+struct alignas(Counter) alignas(Element) alignas(MinAlignment) CounterBlock {
+  unsigned char byte;
+};
+
+// What releasing a shared reference leaves for the caller to do.
+enum class SharedRelease { kNone, kObject, kObjectAndCounter };
+
+// Shared and weak counts of a control block, packed into one word so that
+// every decision is made on a single load or read-modify-write. Atomic is
+// either std::atomic or NonAtomic, so both threading policies run the same
+// code.
+template <template <typename> class Atomic>
+class RefCountPolicy {
+ public:
+  // A lone counter with the same atomicity, for objects that count their
+  // own references (see RefCounted).
+  using Counter = Atomic<uint32_t>;
+
+  void increment_shared_count() {
+    counts_.fetch_add(kShared, std::memory_order_relaxed);
+  }
+
+  SharedRelease decrement_shared_count() {
+    // Nobody else can reach the counter if this is the only reference,
+    // including weak ones, so there is nothing to write back.
+    if (counts_.load(std::memory_order_acquire) == kShared + kWeak) {
+      return SharedRelease::kObjectAndCounter;
+    }
+    uint64_t counts = counts_.fetch_sub(kShared, std::memory_order_acq_rel);
+    if (shared_of(counts) != 1) {
+      return SharedRelease::kNone;
+    }
+    return counts == kShared + kWeak ? SharedRelease::kObjectAndCounter
+                                     : SharedRelease::kObject;
+  }
+
+  // Batched forms for holders of many references at once, such as
+  // AtomicSharedPtr.
+  void increment_shared_count_by(uint32_t count) {
+    counts_.fetch_add(kShared * count, std::memory_order_relaxed);
+  }
+
+  SharedRelease decrement_shared_count_by(uint32_t count) {
+    uint64_t counts =
+        counts_.fetch_sub(kShared * count, std::memory_order_acq_rel);
+    if (shared_of(counts) != count) {
+      return SharedRelease::kNone;
+    }
+    return counts == kShared * count + kWeak
+               ? SharedRelease::kObjectAndCounter
+               : SharedRelease::kObject;
+  }
+
+  bool increment_shared_count_if_nonzero() {
+    uint64_t counts = counts_.load(std::memory_order_relaxed);
+    while (shared_of(counts) != 0) {
+      if (counts_.compare_exchange_weak(counts, counts + kShared,
+                                        std::memory_order_acq_rel,
+                                        std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void increment_weak_count() {
+    counts_.fetch_add(kWeak, std::memory_order_relaxed);
+  }
+
+  bool decrement_weak_count() {
+    return counts_.fetch_sub(kWeak, std::memory_order_acq_rel) == kWeak;
+  }
+
+  uint32_t get_shared_count() const {
+    return shared_of(counts_.load(std::memory_order_acquire));
+  }
+
+  // The owning SharedPtrs collectively hold one weak reference, so the
+  // counter outlives destroy() until the last WeakPtr is gone.
+  uint32_t get_weak_count() const {
+    uint64_t counts = counts_.load(std::memory_order_acquire);
+    uint32_t weak_count = static_cast<uint32_t>(counts / kWeak);
+    return shared_of(counts) > 0 ? weak_count - 1 : weak_count;
+  }
+
+ private:
+  // The shared count lives in the low half, the weak count in the high one.
+  static constexpr uint64_t kShared = 1;
+  static constexpr uint64_t kWeak = uint64_t{1} << 32;
+
+  static uint32_t shared_of(uint64_t counts) {
+    return static_cast<uint32_t>(counts);
+  }
+
+  Atomic<uint64_t> counts_{kShared + kWeak};
+};
+
+using SingleThreadPolicy = RefCountPolicy<NonAtomic>;
+using MultiThreadPolicy = RefCountPolicy<std::atomic>;
+
+class BiasedThreadPolicy;
+
+// Owner record of a thread for BiasedThreadPolicy. It outlives its thread
+// while control blocks still name it as their owner.
+class BiasedThreadState {
+ public:
+  // Null once the thread is past its handle's destruction at exit.
+  static BiasedThreadState* current() {
+    if (!current_ && !exited_) {
+      thread_local ThreadHandle handle;
+      current_ = handle.state;
+    }
+    return current_;
+  }
+
+  void acquire() { ref_count_.fetch_add(1, std::memory_order_relaxed); }
+
+  void release() {
+    if (ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  // Hands counts over to the owner thread for merging. Returns false once
+  // the owner has exited, in which case the caller merges them itself.
+  bool enqueue(BiasedThreadPolicy* counts) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (detached_) {
+      return false;
+    }
+    queue_.push_back(counts);
+    has_queued_.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  void process_queue();
+
+  void process_queue_if_pending() {
+    if (has_queued_.load(std::memory_order_relaxed)) {
+      process_queue();
+    }
+  }
+
+ private:
+  struct ThreadHandle {
+    ThreadHandle() : state(new BiasedThreadState) {}
+
+    ~ThreadHandle() {
+      exited_ = true;
+      current_ = nullptr;
+      state->detach();
+    }
+
+    BiasedThreadState* state;
+  };
+
+  void detach() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      detached_ = true;
+    }
+    process_queue();
+    release();
+  }
+
+  static inline thread_local BiasedThreadState* current_ = nullptr;
+  static inline thread_local bool exited_ = false;
+
+  std::atomic<uint32_t> ref_count_{1};
+  std::mutex mutex_;
+  std::vector<BiasedThreadPolicy*> queue_;
+  std::atomic<bool> has_queued_{false};
+  // Set once the owner thread has exited.
+  bool detached_ = false;
+};
+
+// Biased reference counting: the thread that created the control block
+// counts its own shared references non-atomically, every other thread goes
+// through an atomic counter. The two are merged when the owner's count
+// drops to zero, or once the atomic counter goes negative: the block is then
+// queued to the owner, which merges it on its next biased release, in
+// ProcessBiasedMerges() or when it exits. Blocks created by a thread that is
+// already exiting have no owner and start out merged, counting atomically
+// only.
+class BiasedThreadPolicy {
+ public:
+  BiasedThreadPolicy() : owner_(BiasedThreadState::current()) {
+    if (owner_) {
+      owner_->acquire();
+    } else {
+      shared_count_.store(kOne | kMerged, std::memory_order_relaxed);
+      biased_count_.store(0, std::memory_order_relaxed);
+      merged_ = true;
+    }
+  }
+
+  BiasedThreadPolicy(const BiasedThreadPolicy&) = delete;
+
+  ~BiasedThreadPolicy() {
+    if (owner_) {
+      owner_->release();
+    }
+  }
+
+  void increment_shared_count() {
+    if (is_owner()) {
+      biased_count_.store(biased_count_.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+    } else {
+      shared_count_.fetch_add(kOne, std::memory_order_relaxed);
+    }
+  }
+
+  SharedRelease decrement_shared_count() {
+    bool last = false;
+    if (is_owner()) {
+      last = decrement_biased_count();
+      owner_->process_queue_if_pending();
+    } else {
+      int64_t word =
+          shared_count_.fetch_sub(kOne, std::memory_order_acq_rel) - kOne;
+      if (word & kMerged) {
+        last = count_of(word) == 0;
+      } else if (count_of(word) < 0 && !(word & kQueued)) {
+        last = queue_merge();
+      }
+    }
+    return last ? SharedRelease::kObject : SharedRelease::kNone;
+  }
+
+  // Fails once the two counts add up to zero, even while the owner has yet
+  // to merge them, so that it agrees with get_shared_count(). A queued
+  // block whose owner still holds biased references is alive, and other
+  // threads promote it without waiting for the owner: the object dies only
+  // on an update of the atomic word, which their compare-and-swap would
+  // have seen.
+  bool increment_shared_count_if_nonzero() {
+    if (is_owner()) {
+      owner_->process_queue_if_pending();
+    }
+    if (is_owner()) {
+      if (total_count(shared_count_.load(std::memory_order_acquire)) <= 0) {
+        return false;
+      }
+      increment_shared_count();
+      return true;
+    }
+    int64_t word = shared_count_.load(std::memory_order_acquire);
+    while (total_count(word) > 0) {
+      if (shared_count_.compare_exchange_weak(word, word + kOne,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_acquire)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void increment_weak_count() {
+    weak_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  bool decrement_weak_count() {
+    return weak_count_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+  uint32_t get_shared_count() const {
+    int64_t count = total_count(shared_count_.load(std::memory_order_acquire));
+    return count > 0 ? static_cast<uint32_t>(count) : 0;
+  }
+
+  uint32_t get_weak_count() const {
+    uint32_t weak_count = weak_count_.load(std::memory_order_acquire);
+    return get_shared_count() > 0 ? weak_count - 1 : weak_count;
+  }
+
+ private:
+  friend class BiasedThreadState;
+
+  // shared_count_ keeps the signed count above two flag bits.
+  static constexpr int64_t kMerged = 1;
+  static constexpr int64_t kQueued = 2;
+  static constexpr int64_t kOne = 4;
+
+  static int64_t count_of(int64_t word) { return word >> 2; }
+
+  // The shared count given word, a value of shared_count_: its own count
+  // plus, until the merge, the biased one. A merge between the two loads
+  // has already moved the biased count into the word, so it is read again.
+  int64_t total_count(int64_t word) const {
+    while (!(word & kMerged)) {
+      int64_t biased_count = biased_count_.load(std::memory_order_acquire);
+      int64_t current = shared_count_.load(std::memory_order_acquire);
+      if (!(current & kMerged)) {
+        return count_of(word) + biased_count;
+      }
+      word = current;
+    }
+    return count_of(word);
+  }
+
+  bool is_owner() const {
+    return owner_ == BiasedThreadState::current() && !merged_;
+  }
+
+  bool decrement_biased_count() {
+    uint32_t biased_count = biased_count_.load(std::memory_order_relaxed) - 1;
+    biased_count_.store(biased_count, std::memory_order_relaxed);
+    if (biased_count != 0) {
+      return false;
+    }
+    merged_ = true;
+    return count_of(shared_count_.fetch_or(
+               kMerged, std::memory_order_acq_rel)) == 0;
+  }
+
+  // The atomic counter went negative, so only the owner's biased references
+  // keep the object alive. The queue holds a weak reference until the owner
+  // gets to it.
+  bool queue_merge() {
+    int64_t word = shared_count_.fetch_or(kQueued, std::memory_order_acq_rel);
+    if (word & (kQueued | kMerged)) {
+      return false;
+    }
+    increment_weak_count();
+    if (owner_->enqueue(this)) {
+      return false;
+    }
+    decrement_weak_count();
+    return merge();
+  }
+
+  // Folds the biased count into the atomic one. Returns true if no shared
+  // references remain.
+  bool merge() {
+    merged_ = true;
+    int64_t biased_count = biased_count_.load(std::memory_order_relaxed);
+    int64_t delta = biased_count * kOne + kMerged;
+    int64_t word =
+        shared_count_.fetch_add(delta, std::memory_order_acq_rel) + delta;
+    // Released so that a thread reading the zero also sees the merge.
+    biased_count_.store(0, std::memory_order_release);
+    return count_of(word) == 0;
+  }
+
+  void release_queued() { release_queued_(this, !merged_ && merge()); }
+
+ protected:
+  // Set by the control block: drops the weak reference held by the queue
+  // and, if last is set, the shared one.
+  void (*release_queued_)(BiasedThreadPolicy* counts, bool last) = nullptr;
+
+ private:
+  BiasedThreadState* owner_;
+  std::atomic<int64_t> shared_count_{0};
+  std::atomic<uint32_t> biased_count_{1};
+  std::atomic<uint32_t> weak_count_{1};
+  bool merged_ = false;
+};
+
+inline void BiasedThreadState::process_queue() {
+  std::vector<BiasedThreadPolicy*> queue;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue.swap(queue_);
+    has_queued_.store(false, std::memory_order_relaxed);
+  }
+  for (BiasedThreadPolicy* counts : queue) {
+    counts->release_queued();
+  }
+}
+
+// Merges the control blocks that other threads handed back to the calling
+// thread. Runs automatically when the thread exits.
+inline void ProcessBiasedMerges() {
+  if (BiasedThreadState* state = BiasedThreadState::current()) {
+    state->process_queue();
+  }
+}
+
+// MultiThreadPolicy that takes destruction off the releasing thread: when
+// the last shared reference goes, the control block is queued on
+// DeferredReclaimer and the object is destroyed when it is drained. The
+// object is unreachable from then on; WeakPtr::lock already fails.
+class DeferredPolicy : public MultiThreadPolicy {
+ public:
+  SharedRelease decrement_shared_count() {
+    return defer(MultiThreadPolicy::decrement_shared_count());
+  }
+
+  SharedRelease decrement_shared_count_by(uint32_t count) {
+    return defer(MultiThreadPolicy::decrement_shared_count_by(count));
+  }
+
+ protected:
+  // Set by the control block: runs the release the queue postponed.
+  void (*release_deferred_)(DeferredPolicy* counts,
+                            bool last_reference) = nullptr;
+
+ private:
+  friend class DeferredReclaimer;
+
+  SharedRelease defer(SharedRelease release);
+
+  DeferredPolicy* next_deferred_ = nullptr;
+  int64_t deferred_at_ns_ = 0;
+  bool last_reference_ = false;
+};
+
+// Queue of control blocks released under DeferredPolicy, reclaimed by
+// drain(), either called explicitly or from a background thread. Pushing is
+// a lock-free push onto a PushStack that drain() takes over in one
+// exchange. Once max_depth blocks are waiting, further releases run inline
+// on the releasing thread instead.
+class DeferredReclaimer {
+ public:
+  struct Metrics {
+    // Blocks waiting right now, and the most there have been at once.
+    size_t depth = 0;
+    size_t peak_depth = 0;
+    uint64_t deferred = 0;
+    uint64_t reclaimed = 0;
+    // Releases run inline because the queue was at max_depth.
+    uint64_t inline_releases = 0;
+    // Time from queueing to reclaiming, in nanoseconds.
+    uint64_t max_lag_ns = 0;
+    uint64_t total_lag_ns = 0;
+  };
+
+  static DeferredReclaimer& instance() {
+    static DeferredReclaimer* reclaimer = new DeferredReclaimer;
+    return *reclaimer;
+  }
+
+  // Returns false if the queue is full and the caller has to release.
+  bool push(DeferredPolicy* counts);
+
+  // Reclaims everything queued, including blocks released by the
+  // destructors it runs. Returns how many blocks it reclaimed.
+  size_t drain();
+
+  void set_max_depth(size_t max_depth) {
+    max_depth_.store(max_depth, std::memory_order_relaxed);
+  }
+
+  // Drains every interval, or sooner once the queue is half full, until
+  // stop() is called. stop() has to run before the program exits.
+  void start(std::chrono::milliseconds interval);
+
+  void stop();
+
+  Metrics metrics() const;
+
+ private:
+  DeferredReclaimer() = default;
+
+  static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  PushStack<DeferredPolicy, &DeferredPolicy::next_deferred_> queue_;
+  std::atomic<size_t> depth_{0};
+  std::atomic<size_t> max_depth_{size_t{1} << 16};
+
+  std::atomic<size_t> peak_depth_{0};
+  std::atomic<uint64_t> deferred_{0};
+  std::atomic<uint64_t> reclaimed_{0};
+  std::atomic<uint64_t> inline_releases_{0};
+  std::atomic<uint64_t> max_lag_ns_{0};
+  std::atomic<uint64_t> total_lag_ns_{0};
+
+  PeriodicWorker worker_;
+};
+
+inline SharedRelease DeferredPolicy::defer(SharedRelease release) {
+  if (release == SharedRelease::kNone) {
+    return release;
+  }
+  last_reference_ = release == SharedRelease::kObjectAndCounter;
+  return DeferredReclaimer::instance().push(this) ? SharedRelease::kNone
+                                                  : release;
+}
+
+inline bool DeferredReclaimer::push(DeferredPolicy* counts) {
+  size_t max_depth = max_depth_.load(std::memory_order_relaxed);
+  if (depth_.load(std::memory_order_relaxed) >= max_depth) {
+    inline_releases_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  counts->deferred_at_ns_ = now_ns();
+  queue_.push(counts);
+  deferred_.fetch_add(1, std::memory_order_relaxed);
+  size_t depth = depth_.fetch_add(1, std::memory_order_relaxed) + 1;
+  size_t peak_depth = peak_depth_.load(std::memory_order_relaxed);
+  while (depth > peak_depth &&
+         !peak_depth_.compare_exchange_weak(peak_depth, depth,
+                                            std::memory_order_relaxed)) {
+  }
+  if (depth == max_depth / 2) {
+    worker_.wake();
+  }
+  return true;
+}
+
+inline size_t DeferredReclaimer::drain() {
+  size_t reclaimed = 0;
+  while (DeferredPolicy* counts = queue_.take_all()) {
+    int64_t now = now_ns();
+    uint64_t max_lag = 0;
+    uint64_t total_lag = 0;
+    size_t count = 0;
+    for (DeferredPolicy* it = counts; it; it = it->next_deferred_) {
+      uint64_t lag = static_cast<uint64_t>(now - it->deferred_at_ns_);
+      max_lag = lag > max_lag ? lag : max_lag;
+      total_lag += lag;
+      ++count;
+    }
+    // Subtracted first, so that blocks the destructors below release count
+    // against an accurate depth.
+    depth_.fetch_sub(count, std::memory_order_relaxed);
+    while (counts) {
+      DeferredPolicy* next = counts->next_deferred_;
+      counts->release_deferred_(counts, counts->last_reference_);
+      counts = next;
+    }
+    reclaimed_.fetch_add(count, std::memory_order_relaxed);
+    total_lag_ns_.fetch_add(total_lag, std::memory_order_relaxed);
+    uint64_t seen_max = max_lag_ns_.load(std::memory_order_relaxed);
+    while (max_lag > seen_max &&
+           !max_lag_ns_.compare_exchange_weak(seen_max, max_lag,
+                                              std::memory_order_relaxed)) {
+    }
+    reclaimed += count;
+  }
+  return reclaimed;
+}
+
+inline void DeferredReclaimer::start(std::chrono::milliseconds interval) {
+  worker_.start(interval, [this] { drain(); });
+}
+
+inline void DeferredReclaimer::stop() {
+  worker_.stop();
+  drain();
+}
+
+inline DeferredReclaimer::Metrics DeferredReclaimer::metrics() const {
+  Metrics metrics;
+  metrics.depth = depth_.load(std::memory_order_relaxed);
+  metrics.peak_depth = peak_depth_.load(std::memory_order_relaxed);
+  metrics.deferred = deferred_.load(std::memory_order_relaxed);
+  metrics.reclaimed = reclaimed_.load(std::memory_order_relaxed);
+  metrics.inline_releases = inline_releases_.load(std::memory_order_relaxed);
+  metrics.max_lag_ns = max_lag_ns_.load(std::memory_order_relaxed);
+  metrics.total_lag_ns = total_lag_ns_.load(std::memory_order_relaxed);
+  return metrics;
+}
+
+// Reclaims the control blocks queued under DeferredPolicy on the calling
+// thread. Returns how many there were.
+inline size_t DrainDeferred() { return DeferredReclaimer::instance().drain(); }
+
+// Counts of one owned object and the way to destroy it, whatever type the
+// SharedPtrs and WeakPtrs sharing them point to. The counters below derive
+// from it.
+template <typename Policy>
+class ControlBlock : public Policy {
+ public:
+  // The object as the SharedPtr<T> that created the counter saw it: a T*,
+  // or the first element for arrays.
+  void* get_ptr() const { return ops_->get_ptr(this); }
+
+  template <typename Counter>
+  bool is_a() const {
+    return ops_ == &OpsFor<Counter>::kOps;
+  }
+
+  void release_shared() { finish_release(this->decrement_shared_count()); }
+
+  void release_shared_by(uint32_t count) {
+    finish_release(this->decrement_shared_count_by(count));
+  }
+
+  void release_weak() {
+    if (this->decrement_weak_count()) {
+      ops_->deallocate(this);
+    }
+  }
+
+ protected:
+  // One static record per counter type instead of a vtable, so the
+  // counter is just the counts and this pointer.
+  struct Ops {
+    void* (*get_ptr)(const ControlBlock* counter);
+    // Destroys the object and then deallocates the counter as well if
+    // last_reference is set or the collective weak reference was the last.
+    void (*release_object)(ControlBlock* counter, bool last_reference);
+    void (*deallocate)(ControlBlock* counter);
   };
 
+  template <typename Counter>
+  struct OpsFor {
+    static void* get_ptr(const ControlBlock* counter) {
+      return const_cast<void*>(static_cast<const void*>(
+          static_cast<const Counter*>(counter)->get_ptr()));
+    }
+
+    static void release_object(ControlBlock* counter, bool last_reference) {
+      Counter* derived = static_cast<Counter*>(counter);
+      derived->destroy();
+      if (last_reference || derived->decrement_weak_count()) {
+        derived->deallocate();
+      }
+    }
+
+    static void deallocate(ControlBlock* counter) {
+      static_cast<Counter*>(counter)->deallocate();
+    }
+
+    static constexpr Ops kOps = {&get_ptr, &release_object, &deallocate};
+  };
+
+  explicit ControlBlock(const Ops* ops) : ops_(ops) {
+    if constexpr (std::is_same_v<Policy, BiasedThreadPolicy>) {
+      this->release_queued_ = &release_queued;
+    } else if constexpr (std::is_same_v<Policy, DeferredPolicy>) {
+      this->release_deferred_ = &release_deferred;
+    }
+  }
+
+ private:
+  void finish_release(SharedRelease release) {
+    if (release != SharedRelease::kNone) {
+      ops_->release_object(this, release == SharedRelease::kObjectAndCounter);
+    }
+  }
+
+  static void release_deferred(DeferredPolicy* counts, bool last_reference) {
+    ControlBlock* counter = static_cast<ControlBlock*>(counts);
+    counter->ops_->release_object(counter, last_reference);
+  }
+
+  static void release_queued(BiasedThreadPolicy* counts, bool last) {
+    ControlBlock* counter = static_cast<ControlBlock*>(counts);
+    if (last) {
+      counter->ops_->release_object(counter, false);
+    }
+    counter->release_weak();
+  }
+
+  const Ops* ops_;
+};
+
+template <typename T, typename Policy>
+class EnableSharedFromThis;
+
+template <typename T, typename Policy>
+class WeakPtr;
+
+template <typename T, typename Policy = MultiThreadPolicy>
+class SharedPtr {
+ public:
+  // T may be an array, U[] or U[N]; the pointer then addresses its first
+  // element.
+  using element_type = std::remove_extent_t<T>;
+
+  // Selects default-initialization of the object: no zeroing for
+  // trivially constructible types.
+  struct ForOverwrite {};
+
+  // Selects adoption of a shared reference the caller already holds on a
+  // counter, instead of taking a new one.
+  struct AdoptRef {};
+
   template <typename Y>
-  class DirectPtrCounter : public BasePtrCounter {
+  using DefaultDeleter =
+      std::conditional_t<std::is_array_v<T>, std::default_delete<Y[]>,
+                         std::default_delete<Y>>;
+
+  // Shared by every SharedPtr and WeakPtr of the object, whatever their T.
+  using BasePtrCounter = ControlBlock<Policy>;
+
+  template <typename Y, typename Deleter = DefaultDeleter<Y>,
+            typename Alloc = SlabAllocator<Y>>
+  class DirectPtrCounter : public BasePtrCounter,
+                           private EboStorage<Deleter, 0>,
+                           private EboStorage<Alloc, 1> {
    public:
-    explicit DirectPtrCounter(Y* obj) : ptr_(obj) {}
+    using CounterAllocator = typename std::allocator_traits<
+        Alloc>::template rebind_alloc<DirectPtrCounter>;
+
+    explicit DirectPtrCounter(Y* obj, Deleter deleter = Deleter(),
+                              const Alloc& allocator_obj = Alloc())
+        : BasePtrCounter(
+              &BasePtrCounter::template OpsFor<DirectPtrCounter>::kOps),
+          EboStorage<Deleter, 0>(std::move(deleter)),
+          EboStorage<Alloc, 1>(allocator_obj),
+          ptr_(obj) {}
 
-    T* get_ptr() const override { return reinterpret_cast<T*>(ptr_); }
+    element_type* get_ptr() const { return ptr_; }
 
-    void destroy() override {
-      std::default_delete<Y> deleter_obj;
-      deleter_obj(ptr_);
+    void destroy() {
+      EboStorage<Deleter, 0>::value()(ptr_);
       ptr_ = nullptr;
     }
 
-    void deallocate() override {
-      std::allocator<Y> allocator_obj;
-
-      typename std::allocator_traits<std::allocator<Y>>::template rebind_alloc<
-          DirectPtrCounter<Y>>(allocator_obj)
-          .deallocate(this, 1);
+    void deallocate() {
+      CounterAllocator allocator_obj(EboStorage<Alloc, 1>::value());
+      this->~DirectPtrCounter();
+      std::allocator_traits<CounterAllocator>::deallocate(allocator_obj, this,
+                                                          1);
     }
 
    private:
     Y* ptr_;
   };
 
-  class NonDirectPtrCounter : public BasePtrCounter {
+  // The object is aligned to alignof(T) and Layout::kAlignment; the
+  // allocator is asked for that alignment through alignof(NonDirectPtrCounter).
+  template <typename Alloc = std::allocator<T>, typename Layout = PackedLayout>
+  class NonDirectPtrCounter : public BasePtrCounter,
+                              private EboStorage<Alloc> {
    public:
+    using CounterAllocator = typename std::allocator_traits<
+        Alloc>::template rebind_alloc<NonDirectPtrCounter>;
+
     template <typename... Args>
-    explicit NonDirectPtrCounter(Args&&... args)
-        : ptr_obj_(std::forward<Args>(args)...) {}
+    explicit NonDirectPtrCounter(const Alloc& allocator_obj, Args&&... args)
+        : BasePtrCounter(
+              &BasePtrCounter::template OpsFor<NonDirectPtrCounter>::kOps),
+          EboStorage<Alloc>(allocator_obj),
+          ptr_obj_(std::forward<Args>(args)...) {}
+
+    NonDirectPtrCounter(const Alloc& allocator_obj, ForOverwrite)
+        : BasePtrCounter(
+              &BasePtrCounter::template OpsFor<NonDirectPtrCounter>::kOps),
+          EboStorage<Alloc>(allocator_obj) {
+      default_construct(&ptr_obj_);
+    }
+
+    ~NonDirectPtrCounter() {}
+
+    element_type* get_ptr() const {
+      if constexpr (std::is_array_v<T>) {
+        return const_cast<element_type*>(&ptr_obj_[0]);
+      } else {
+        return const_cast<T*>(&ptr_obj_);
+      }
+    }
+
+    void destroy() { destroy_object(&ptr_obj_); }
+
+    void deallocate() {
+      CounterAllocator allocator_obj(this->value());
+      this->~NonDirectPtrCounter();
+      std::allocator_traits<CounterAllocator>::deallocate(allocator_obj, this,
+                                                          1);
+    }
+
+   private:
+    union {
+      alignas(Layout::kAlignment) alignas(T) T ptr_obj_;
+    };
+  };
 
-    T* get_ptr() const override { return const_cast<T*>(&ptr_obj_); }
+  // Control block, length and elements of MakeShared<U[]>(n) in a single
+  // allocation: the elements follow the counter, aligned for element_type.
+  template <typename Alloc = std::allocator<element_type>,
+            typename Layout = PackedLayout>
+  class ArrayPtrCounter : public BasePtrCounter, private EboStorage<Alloc> {
+   public:
+    using Block =
+        CounterBlock<ArrayPtrCounter, element_type, Layout::kAlignment>;
+    using BlockAllocator =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+
+    // init is empty (value-initialization), a const element_type& to copy
+    // or ForOverwrite.
+    template <typename... Init>
+    static ArrayPtrCounter* create(const Alloc& allocator_obj, size_t length,
+                                   const Init&... init) {
+      static_assert(!std::is_array_v<element_type>,
+                    "Elements of U[] cannot be arrays themselves");
+      BlockAllocator allocator(allocator_obj);
+      size_t blocks = block_count(length);
+      Block* storage =
+          std::allocator_traits<BlockAllocator>::allocate(allocator, blocks);
+      ArrayPtrCounter* counter = ::new (static_cast<void*>(storage))
+          ArrayPtrCounter(allocator_obj, length);
+      try {
+        counter->construct_elements(init...);
+      } catch (...) {
+        counter->~ArrayPtrCounter();
+        std::allocator_traits<BlockAllocator>::deallocate(allocator, storage,
+                                                          blocks);
+        throw;
+      }
+      return counter;
+    }
+
+    element_type* get_ptr() const {
+      return reinterpret_cast<element_type*>(
+          reinterpret_cast<char*>(const_cast<ArrayPtrCounter*>(this)) +
+          elements_offset());
+    }
+
+    void destroy() {
+      if constexpr (!std::is_trivially_destructible_v<element_type>) {
+        element_type* elements = get_ptr();
+        for (size_t i = length_; i > 0; --i) {
+          elements[i - 1].~element_type();
+        }
+      }
+    }
+
+    void deallocate() {
+      BlockAllocator allocator_obj(this->value());
+      size_t blocks = block_count(length_);
+      this->~ArrayPtrCounter();
+      std::allocator_traits<BlockAllocator>::deallocate(
+          allocator_obj, reinterpret_cast<Block*>(this), blocks);
+    }
 
-    void destroy() override {
-      std::default_delete<T> deleter_obj;
-      deleter_obj(get_ptr());
+   private:
+    ArrayPtrCounter(const Alloc& allocator_obj, size_t length)
+        : BasePtrCounter(
+              &BasePtrCounter::template OpsFor<ArrayPtrCounter>::kOps),
+          EboStorage<Alloc>(allocator_obj),
+          length_(length) {}
+
+    static size_t elements_offset() {
+      constexpr size_t alignment = alignof(element_type) > Layout::kAlignment
+                                       ? alignof(element_type)
+                                       : Layout::kAlignment;
+      return (sizeof(ArrayPtrCounter) + alignment - 1) / alignment *
+             alignment;
+    }
+
+    static size_t block_count(size_t length) {
+      size_t max_length = (std::numeric_limits<size_t>::max() -
+                           elements_offset() - sizeof(Block)) /
+                          sizeof(element_type);
+      if (length > max_length) {
+        throw std::bad_array_new_length();
+      }
+      return (elements_offset() + length * sizeof(element_type) +
+              sizeof(Block) - 1) /
+             sizeof(Block);
+    }
+
+    template <typename... Init>
+    void construct_elements(const Init&... init) {
+      element_type* elements = get_ptr();
+      size_t i = 0;
+      try {
+        for (; i < length_; ++i) {
+          construct_element(elements + i, init...);
+        }
+      } catch (...) {
+        while (i > 0) {
+          destroy_object(elements + --i);
+        }
+        throw;
+      }
+    }
+
+    static void construct_element(element_type* ptr) {
+      ::new (static_cast<void*>(ptr)) element_type();
+    }
+
+    static void construct_element(element_type* ptr,
+                                  const element_type& init) {
+      ::new (static_cast<void*>(ptr)) element_type(init);
+    }
+
+    static void construct_element(element_type* ptr, ForOverwrite) {
+      ::new (static_cast<void*>(ptr)) element_type;
+    }
+
+    size_t length_;
+  };
+
+  // One object of MakeSharedBatch: counts and object as in
+  // NonDirectPtrCounter, laid out back to back with the rest of the batch in
+  // one slab, which is freed once every object in it is gone.
+  template <typename Alloc = std::allocator<T>>
+  class BatchPtrCounter : public BasePtrCounter {
+   public:
+    // Appends count SharedPtrs to out, the i-th owning factory(i).
+    template <typename Factory>
+    static void create(const Alloc& allocator_obj, size_t count,
+                       Factory& factory, std::vector<SharedPtr>& out) {
+      static_assert(!std::is_array_v<T>, "Batches hold single objects");
+      if (count == 0) {
+        return;
+      }
+      out.reserve(out.size() + count);
+      Slab* slab = Slab::allocate(allocator_obj, count);
+      size_t i = 0;
+      try {
+        for (; i < count; ++i) {
+          BatchPtrCounter* counter = ::new (static_cast<void*>(slab->slot(i)))
+              BatchPtrCounter(slab, factory, i);
+          out.emplace_back(AdoptRef(), static_cast<BasePtrCounter*>(counter));
+          out.back().link_shared_from_this(out.back().get());
+        }
+      } catch (...) {
+        slab->release(count - i);
+        throw;
+      }
     }
 
-    void deallocate() override {
-      std::allocator<T> allocator_obj;
+    ~BatchPtrCounter() {}
 
-      typename std::allocator_traits<std::allocator<T>>::template rebind_alloc<
-          NonDirectPtrCounter>(allocator_obj)
-          .deallocate(this, 1);
+    element_type* get_ptr() const { return const_cast<T*>(&ptr_obj_); }
+
+    void destroy() { destroy_object(&ptr_obj_); }
+
+    void deallocate() {
+      Slab* slab = slab_;
+      this->~BatchPtrCounter();
+      slab->release(1);
     }
 
    private:
-    T ptr_obj_;
+    // Header of the allocation, followed by the counters. live_ counts the
+    // counters not yet deallocated.
+    class Slab : private EboStorage<Alloc> {
+     public:
+      using Block = CounterBlock<BatchPtrCounter, Slab>;
+      using BlockAllocator =
+          typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+
+      static Slab* allocate(const Alloc& allocator_obj, size_t count) {
+        BlockAllocator allocator(allocator_obj);
+        Block* storage = std::allocator_traits<BlockAllocator>::allocate(
+            allocator, block_count(count));
+        return ::new (static_cast<void*>(storage))
+            Slab(allocator_obj, count);
+      }
+
+      void* slot(size_t index) {
+        return reinterpret_cast<char*>(this) + slots_offset() +
+               index * sizeof(BatchPtrCounter);
+      }
+
+      void release(size_t slots) {
+        if (live_.fetch_sub(slots, std::memory_order_acq_rel) == slots) {
+          BlockAllocator allocator(this->value());
+          size_t blocks = block_count(count_);
+          this->~Slab();
+          std::allocator_traits<BlockAllocator>::deallocate(
+              allocator, reinterpret_cast<Block*>(this), blocks);
+        }
+      }
+
+     private:
+      Slab(const Alloc& allocator_obj, size_t count)
+          : EboStorage<Alloc>(allocator_obj), live_(count), count_(count) {}
+
+      static size_t slots_offset() {
+        return (sizeof(Slab) + alignof(BatchPtrCounter) - 1) /
+               alignof(BatchPtrCounter) * alignof(BatchPtrCounter);
+      }
+
+      static size_t block_count(size_t count) {
+        size_t max_count = (std::numeric_limits<size_t>::max() -
+                            slots_offset() - sizeof(Block)) /
+                           sizeof(BatchPtrCounter);
+        if (count > max_count) {
+          throw std::bad_array_new_length();
+        }
+        return (slots_offset() + count * sizeof(BatchPtrCounter) +
+                sizeof(Block) - 1) /
+               sizeof(Block);
+      }
+
+      std::atomic<size_t> live_;
+      size_t count_;
+    };
+
+    template <typename Factory>
+    BatchPtrCounter(Slab* slab, Factory& factory, size_t index)
+        : BasePtrCounter(
+              &BasePtrCounter::template OpsFor<BatchPtrCounter>::kOps),
+          slab_(slab),
+          ptr_obj_(factory(index)) {}
+
+    Slab* slab_;
+    union {
+      T ptr_obj_;
+    };
   };
 
+  // Takes a shared reference on ptr_counter, which a SharedPtr<T, Policy>
+  // created.
   SharedPtr(BasePtrCounter* ptr_counter);
 
+  // Adopts a shared reference already held on ptr_counter, which a
+  // SharedPtr<T, Policy> created.
+  SharedPtr(AdoptRef, BasePtrCounter* ptr_counter);
+
   SharedPtr();
 
   template <typename Y>
   SharedPtr(Y* ptr);
 
+  // deleter(ptr) runs once the last SharedPtr is gone, or right away if
+  // the counter cannot be allocated. The counter comes from SlabPool.
+  template <typename Y, typename Deleter>
+  SharedPtr(Y* ptr, Deleter deleter);
+
+  // Same, with the counter allocated from (a rebound copy of) allocator_obj,
+  // which is kept in the counter to free it.
+  template <typename Y, typename Deleter, typename Alloc>
+  SharedPtr(Y* ptr, Deleter deleter, const Alloc& allocator_obj);
+
   SharedPtr(const SharedPtr& other_ptr);
 
   SharedPtr(SharedPtr&& other_ptr);
 
+  // Aliasing: shares owner's control block but points to ptr, typically a
+  // member or an element of the object owner points to. ptr is not deleted
+  // and must stay valid while the owner's object is alive.
+  template <typename Y>
+  SharedPtr(const SharedPtr<Y, Policy>& owner, element_type* ptr);
+
+  // Same, taking owner's reference over without touching the count.
+  template <typename Y>
+  SharedPtr(SharedPtr<Y, Policy>&& owner, element_type* ptr);
+
   const SharedPtr& operator=(const SharedPtr& other_ptr);
 
   template <typename Y>
-  const SharedPtr& operator=(const SharedPtr<Y>& other_ptr);
+  const SharedPtr& operator=(const SharedPtr<Y, Policy>& other_ptr);
 
   const SharedPtr& operator=(SharedPtr&& other_ptr);
 
-  T* get() const;
+  element_type* get() const;
 
   BasePtrCounter* get_ptr_counter() const { return ptr_counter_; }
 
-  T& operator*() const;
+  element_type& operator*() const;
+
+  element_type* operator->() const;
 
-  T* operator->() const;
+  // Only for arrays.
+  element_type& operator[](std::ptrdiff_t index) const;
 
   uint32_t use_count() const;
 
+  // Orders by control block, so all the SharedPtrs and WeakPtrs of one
+  // object are equivalent whatever they point to.
+  template <typename Y>
+  bool owner_before(const SharedPtr<Y, Policy>& other_ptr) const;
+
+  template <typename Y>
+  bool owner_before(const WeakPtr<Y, Policy>& other_ptr) const;
+
   void reset();
 
   void reset_ptr() { this->ptr_ = nullptr; }
 
-  void reset_ptr_counter() { this->ptr_counter_ = nullptr; }
+  void reset_ptr_counter() { this->ptr_counter_ = nullptr; }
+
+  // Points the EnableSharedFromThis base of ptr, if it has one not already
+  // in use, at the object this owns. Called wherever a control block takes
+  // a new object.
+  template <typename Y>
+  void link_shared_from_this(Y* ptr) const;
+
+  // Empties the EnableSharedFromThis base of ptr, if it has one, for
+  // owners such as SharedPool whose objects outlive their control blocks.
+  template <typename Y>
+  static void unlink_shared_from_this(Y* ptr);
+
+  ~SharedPtr();
+
+ private:
+  template <typename Y, typename OtherPolicy>
+  friend class WeakPtr;
+
+  // Adopts a shared reference already held on ptr_counter, pointing at ptr.
+  SharedPtr(BasePtrCounter* ptr_counter, element_type* ptr)
+      : ptr_counter_(ptr_counter), ptr_(ptr) {}
+
+  template <typename U>
+  static EnableSharedFromThis<U, Policy>* shared_from_this_base(
+      EnableSharedFromThis<U, Policy>* base);
+
+  static void shared_from_this_base(...);
+
+  // EnableSharedFromThis<U, Policy> if Y derives from one, void otherwise.
+  template <typename Y>
+  using SharedFromThisBase = std::remove_pointer_t<decltype(
+      shared_from_this_base(std::declval<std::remove_cv_t<Y>*>()))>;
+
+  // Array elements are constructed one by one: placement array new may
+  // ask for more room than sizeof(U).
+  template <typename U>
+  static void default_construct(U* ptr) {
+    if constexpr (std::is_array_v<U>) {
+      size_t i = 0;
+      try {
+        for (; i < std::extent_v<U>; ++i) {
+          default_construct(&(*ptr)[i]);
+        }
+      } catch (...) {
+        while (i > 0) {
+          destroy_object(&(*ptr)[--i]);
+        }
+        throw;
+      }
+    } else {
+      ::new (static_cast<void*>(ptr)) U;
+    }
+  }
+
+  template <typename U>
+  static void destroy_object(U* ptr) {
+    if constexpr (std::is_array_v<U>) {
+      for (size_t i = std::extent_v<U>; i > 0; --i) {
+        destroy_object(&(*ptr)[i - 1]);
+      }
+    } else if constexpr (!std::is_trivially_destructible_v<U>) {
+      ptr->~U();
+    }
+  }
 
-  ~SharedPtr();
+  void release();
 
- private:
   BasePtrCounter* ptr_counter_;
 
-  T* ptr_;
+  element_type* ptr_;
 };
 
-template <typename T>
-SharedPtr<T>::SharedPtr() : ptr_counter_(nullptr), ptr_(nullptr) {}
+template <typename T, typename Policy>
+SharedPtr<T, Policy>::SharedPtr() : ptr_counter_(nullptr), ptr_(nullptr) {}
 
-template <typename T>
-SharedPtr<T>::SharedPtr(BasePtrCounter* ptr_counter)
-    : ptr_counter_(ptr_counter),
-      ptr_(ptr_counter ? ptr_counter->get_ptr() : nullptr) {
+template <typename T, typename Policy>
+SharedPtr<T, Policy>::SharedPtr(BasePtrCounter* ptr_counter)
+    : SharedPtr(AdoptRef(), ptr_counter) {
   if (ptr_counter) {
     ptr_counter->increment_shared_count();
   }
 }
 
-template <typename T>
-template <typename Y>
-SharedPtr<T>::SharedPtr(Y* ptr) : ptr_(reinterpret_cast<T*>(ptr)) {
-  typename std::allocator_traits<std::allocator<Y>>::template rebind_alloc<
-      DirectPtrCounter<Y>>
-      custom_allocator = std::allocator<Y>();
+template <typename T, typename Policy>
+SharedPtr<T, Policy>::SharedPtr(AdoptRef, BasePtrCounter* ptr_counter)
+    : ptr_counter_(ptr_counter),
+      ptr_(ptr_counter ? static_cast<element_type*>(ptr_counter->get_ptr())
+                       : nullptr) {}
 
-  BasePtrCounter* temp_ptr_counter = std::allocator_traits<
-      typename std::allocator_traits<std::allocator<Y>>::template rebind_alloc<
-          DirectPtrCounter<Y>>>::allocate(custom_allocator, 1);
+template <typename T, typename Policy>
+template <typename Y>
+SharedPtr<T, Policy>::SharedPtr(Y* ptr)
+    : SharedPtr(ptr, DefaultDeleter<Y>()) {}
+
+template <typename T, typename Policy>
+template <typename Y, typename Deleter>
+SharedPtr<T, Policy>::SharedPtr(Y* ptr, Deleter deleter)
+    : SharedPtr(ptr, std::move(deleter), SlabAllocator<Y>()) {}
+
+template <typename T, typename Policy>
+template <typename Y, typename Deleter, typename Alloc>
+SharedPtr<T, Policy>::SharedPtr(Y* ptr, Deleter deleter,
+                                const Alloc& allocator_obj)
+    : ptr_(ptr) {
+  using Counter = DirectPtrCounter<Y, Deleter, Alloc>;
+  typename Counter::CounterAllocator custom_allocator(allocator_obj);
+
+  Counter* temp_ptr_counter;
+  try {
+    temp_ptr_counter =
+        std::allocator_traits<typename Counter::CounterAllocator>::allocate(
+            custom_allocator, 1);
+  } catch (...) {
+    deleter(ptr);
+    throw;
+  }
 
-  new (temp_ptr_counter) DirectPtrCounter<Y>(ptr);
+  new (temp_ptr_counter) Counter(ptr, std::move(deleter), allocator_obj);
   ptr_counter_ = temp_ptr_counter;
-  if (ptr_counter_) {
-    ptr_counter_->increment_shared_count();
-  }
+  link_shared_from_this(ptr);
 }
 
-template <typename T>
-SharedPtr<T>::SharedPtr(const SharedPtr& other_ptr)
+template <typename T, typename Policy>
+SharedPtr<T, Policy>::SharedPtr(const SharedPtr& other_ptr)
     : ptr_counter_(other_ptr.get_ptr_counter()), ptr_(other_ptr.get()) {
   if (ptr_counter_) {
     ptr_counter_->increment_shared_count();
   }
 }
 
-template <typename T>
-SharedPtr<T>::SharedPtr(SharedPtr&& other_ptr)
+template <typename T, typename Policy>
+SharedPtr<T, Policy>::SharedPtr(SharedPtr&& other_ptr)
     : ptr_counter_(other_ptr.get_ptr_counter()), ptr_(other_ptr.get()) {
   other_ptr.reset_ptr_counter();
   other_ptr.reset_ptr();
 }
 
-template <typename T>
-const SharedPtr<T>& SharedPtr<T>::operator=(const SharedPtr& other_ptr) {
+template <typename T, typename Policy>
+template <typename Y>
+SharedPtr<T, Policy>::SharedPtr(const SharedPtr<Y, Policy>& owner,
+                                element_type* ptr)
+    : ptr_counter_(owner.get_ptr_counter()), ptr_(ptr) {
+  if (ptr_counter_) {
+    ptr_counter_->increment_shared_count();
+  }
+}
+
+template <typename T, typename Policy>
+template <typename Y>
+SharedPtr<T, Policy>::SharedPtr(SharedPtr<Y, Policy>&& owner,
+                                element_type* ptr)
+    : ptr_counter_(owner.get_ptr_counter()), ptr_(ptr) {
+  owner.reset_ptr_counter();
+  owner.reset_ptr();
+}
+
+template <typename T, typename Policy>
+const SharedPtr<T, Policy>& SharedPtr<T, Policy>::operator=(
+    const SharedPtr& other_ptr) {
   if (this != &other_ptr) {
-    if (ptr_counter_) {
-      this->~SharedPtr();
+    if (other_ptr.get_ptr_counter()) {
+      other_ptr.get_ptr_counter()->increment_shared_count();
     }
-    ptr_counter_ =
-        reinterpret_cast<BasePtrCounter*>(other_ptr.get_ptr_counter());
+    release();
+    ptr_counter_ = other_ptr.get_ptr_counter();
     ptr_ = other_ptr.get();
-    if (ptr_counter_) {
-      ptr_counter_->increment_shared_count();
-    }
   }
   return *this;
 }
 
-template <typename T>
+template <typename T, typename Policy>
 template <typename Y>
-const SharedPtr<T>& SharedPtr<T>::operator=(const SharedPtr<Y>& other_ptr) {
-  if (this != reinterpret_cast<const void*>(&other_ptr)) {
-    if (ptr_counter_) {
-      this->~SharedPtr();
+const SharedPtr<T, Policy>& SharedPtr<T, Policy>::operator=(
+    const SharedPtr<Y, Policy>& other_ptr) {
+  if (this != static_cast<const void*>(&other_ptr)) {
+    if (other_ptr.get_ptr_counter()) {
+      other_ptr.get_ptr_counter()->increment_shared_count();
     }
+    release();
     ptr_ = other_ptr.get();
-    ptr_counter_ = dynamic_cast<BasePtrCounter*>(other_ptr.get_ptr_counter());
-    if (ptr_counter_) {
-      ptr_counter_->increment_shared_count();
-    }
+    ptr_counter_ = other_ptr.get_ptr_counter();
   }
   return *this;
 }
 
-template <typename T>
-const SharedPtr<T>& SharedPtr<T>::operator=(SharedPtr&& other_ptr) {
+template <typename T, typename Policy>
+const SharedPtr<T, Policy>& SharedPtr<T, Policy>::operator=(
+    SharedPtr&& other_ptr) {
   if (this != &other_ptr) {
-    if (ptr_counter_) {
-      this->~SharedPtr();
-    }
-    ptr_counter_ = std::move(
-        reinterpret_cast<BasePtrCounter*>(other_ptr.get_ptr_counter()));
+    release();
+    ptr_counter_ = other_ptr.get_ptr_counter();
     ptr_ = std::move(other_ptr.get());
     other_ptr.reset_ptr();
     other_ptr.reset_ptr_counter();
@@ -207,176 +1355,766 @@ const SharedPtr<T>& SharedPtr<T>::operator=(SharedPtr&& other_ptr) {
   return *this;
 }
 
-template <typename T>
-T* SharedPtr<T>::get() const {
-  if (ptr_) {
-    return ptr_;
-  }
-  return ptr_counter_ ? ptr_counter_->get_ptr() : nullptr;
+template <typename T, typename Policy>
+typename SharedPtr<T, Policy>::element_type* SharedPtr<T, Policy>::get()
+    const {
+  return ptr_;
 }
 
-template <typename T>
-T& SharedPtr<T>::operator*() const {
-  return ptr_ ? *ptr_ : *(ptr_counter_->get_ptr());
+template <typename T, typename Policy>
+typename SharedPtr<T, Policy>::element_type& SharedPtr<T, Policy>::operator*()
+    const {
+  return *ptr_;
 }
 
-template <typename T>
-T* SharedPtr<T>::operator->() const {
+template <typename T, typename Policy>
+typename SharedPtr<T, Policy>::element_type*
+SharedPtr<T, Policy>::operator->() const {
   return this->get();
 }
 
-template <typename T>
-uint32_t SharedPtr<T>::use_count() const {
+template <typename T, typename Policy>
+typename SharedPtr<T, Policy>::element_type& SharedPtr<T, Policy>::operator[](
+    std::ptrdiff_t index) const {
+  static_assert(std::is_array_v<T>, "operator[] needs SharedPtr<U[]>");
+  return ptr_[index];
+}
+
+template <typename T, typename Policy>
+uint32_t SharedPtr<T, Policy>::use_count() const {
   return ptr_counter_ ? ptr_counter_->get_shared_count() : 0;
 }
 
-template <typename T>
-void SharedPtr<T>::reset() {
-  *this = SharedPtr<T>();
+template <typename T, typename Policy>
+void SharedPtr<T, Policy>::reset() {
+  *this = SharedPtr<T, Policy>();
 }
 
-template <typename T>
-SharedPtr<T>::~SharedPtr() {
-  if (ptr_counter_ && ptr_counter_->get_shared_count() > 0) {
-    ptr_counter_->decrement_shared_count();
-    if (ptr_counter_->get_shared_count() == 0) {
-      ptr_counter_->destroy();
-      if (ptr_counter_->get_weak_count() == 0) {
-        ptr_counter_->deallocate();
-      }
-    }
+template <typename T, typename Policy>
+void SharedPtr<T, Policy>::release() {
+  if (ptr_counter_) {
+    ptr_counter_->release_shared();
   }
 }
 
-template <typename T>
+template <typename T, typename Policy>
+SharedPtr<T, Policy>::~SharedPtr() {
+  release();
+}
+
+template <typename T, typename Policy = MultiThreadPolicy>
 class WeakPtr {
  public:
+  using element_type = typename SharedPtr<T, Policy>::element_type;
+
   WeakPtr();
 
+  WeakPtr(const WeakPtr& other_ptr);
+
+  WeakPtr(WeakPtr&& other_ptr);
+
   template <typename Y>
-  WeakPtr(const WeakPtr<Y>& other_ptr);
+  WeakPtr(const WeakPtr<Y, Policy>& other_ptr);
 
   template <typename Y>
-  WeakPtr(WeakPtr<Y>&& other_ptr);
+  WeakPtr(WeakPtr<Y, Policy>&& other_ptr);
 
   template <typename Y>
-  WeakPtr(const SharedPtr<Y>& other_ptr);
+  WeakPtr(const SharedPtr<Y, Policy>& other_ptr);
 
   bool expired();
 
-  typename SharedPtr<T>::BasePtrCounter* lock();
+  // Both take a shared reference only while the object is still alive, in
+  // one compare-and-swap on the shared count, and point where the SharedPtr
+  // the reference was made from pointed. lock() throws std::runtime_error
+  // if the object is gone; try_lock() returns an empty SharedPtr instead.
+  SharedPtr<T, Policy> lock() const;
+
+  SharedPtr<T, Policy> try_lock() const;
+
+  typename SharedPtr<T, Policy>::BasePtrCounter* get_ptr_counter() const {
+    return ptr_counter_;
+  }
+
+  // Same as SharedPtr::owner_before. The order holds after the object dies.
+  template <typename Y>
+  bool owner_before(const SharedPtr<Y, Policy>& other_ptr) const;
+
+  template <typename Y>
+  bool owner_before(const WeakPtr<Y, Policy>& other_ptr) const;
+
+  const WeakPtr<T, Policy>& operator=(const WeakPtr& other_ptr);
+
+  WeakPtr<T, Policy>& operator=(WeakPtr&& other_ptr);
 
   template <typename Y>
-  const WeakPtr<T>& operator=(const WeakPtr<Y>& other_ptr);
+  const WeakPtr<T, Policy>& operator=(const WeakPtr<Y, Policy>& other_ptr);
 
   template <typename Y>
-  WeakPtr<T>& operator=(WeakPtr<Y>&& other_ptr);
+  WeakPtr<T, Policy>& operator=(WeakPtr<Y, Policy>&& other_ptr);
 
   ~WeakPtr();
 
  private:
-  template <typename Y>
+  template <typename Y, typename OtherPolicy>
   friend class WeakPtr;
 
-  typename SharedPtr<T>::BasePtrCounter* ptr_counter_;
+  template <typename Y, typename OtherPolicy>
+  friend class SharedPtr;
+
+  // Takes a weak reference of its own on ptr_counter.
+  WeakPtr(typename SharedPtr<T, Policy>::BasePtrCounter* ptr_counter,
+          element_type* ptr);
+
+  // other_ptr's pointer as a T*, or null once the object is gone: when T is
+  // a virtual base of Y the conversion reads the object, so it is made only
+  // under a shared reference.
+  template <typename Y>
+  static element_type* converted(const WeakPtr<Y, Policy>& other_ptr);
+
+  void release();
+
+  typename SharedPtr<T, Policy>::BasePtrCounter* ptr_counter_;
+  element_type* ptr_;
 };
 
-template <typename T>
-WeakPtr<T>::WeakPtr() : ptr_counter_(nullptr) {}
+template <typename T, typename Policy>
+WeakPtr<T, Policy>::WeakPtr() : ptr_counter_(nullptr), ptr_(nullptr) {}
+
+template <typename T, typename Policy>
+WeakPtr<T, Policy>::WeakPtr(const WeakPtr& other_ptr)
+    : ptr_counter_(other_ptr.ptr_counter_), ptr_(other_ptr.ptr_) {
+  if (ptr_counter_) {
+    ptr_counter_->increment_weak_count();
+  }
+}
+
+template <typename T, typename Policy>
+WeakPtr<T, Policy>::WeakPtr(
+    typename SharedPtr<T, Policy>::BasePtrCounter* ptr_counter,
+    element_type* ptr)
+    : ptr_counter_(ptr_counter), ptr_(ptr) {
+  if (ptr_counter_) {
+    ptr_counter_->increment_weak_count();
+  }
+}
+
+template <typename T, typename Policy>
+WeakPtr<T, Policy>::WeakPtr(WeakPtr&& other_ptr)
+    : ptr_counter_(other_ptr.ptr_counter_), ptr_(other_ptr.ptr_) {
+  other_ptr.ptr_counter_ = nullptr;
+  other_ptr.ptr_ = nullptr;
+}
+
+template <typename T, typename Policy>
+template <typename Y>
+typename WeakPtr<T, Policy>::element_type* WeakPtr<T, Policy>::converted(
+    const WeakPtr<Y, Policy>& other_ptr) {
+  return other_ptr.try_lock().get();
+}
 
-template <typename T>
+template <typename T, typename Policy>
 template <typename Y>
-WeakPtr<T>::WeakPtr(const WeakPtr<Y>& other_ptr)
-    : ptr_counter_(reinterpret_cast<typename SharedPtr<T>::BasePtrCounter*>(
-          other_ptr.ptr_counter_)) {
+WeakPtr<T, Policy>::WeakPtr(const WeakPtr<Y, Policy>& other_ptr)
+    : ptr_counter_(other_ptr.ptr_counter_), ptr_(converted(other_ptr)) {
   if (ptr_counter_) {
     ptr_counter_->increment_weak_count();
   }
 }
 
-template <typename T>
+template <typename T, typename Policy>
 template <typename Y>
-WeakPtr<T>::WeakPtr(WeakPtr<Y>&& other_ptr)
-    : ptr_counter_(reinterpret_cast<typename SharedPtr<T>::BasePtrCounter*>(
-          other_ptr.ptr_counter_)) {
+WeakPtr<T, Policy>::WeakPtr(WeakPtr<Y, Policy>&& other_ptr)
+    : ptr_counter_(other_ptr.ptr_counter_), ptr_(converted(other_ptr)) {
   other_ptr.ptr_counter_ = nullptr;
+  other_ptr.ptr_ = nullptr;
 }
 
-template <typename T>
+template <typename T, typename Policy>
 template <typename Y>
-WeakPtr<T>::WeakPtr(const SharedPtr<Y>& other_ptr)
-    : ptr_counter_(reinterpret_cast<typename SharedPtr<T>::BasePtrCounter*>(
-          other_ptr.get_ptr_counter())) {
-  ptr_counter_->increment_weak_count();
+WeakPtr<T, Policy>::WeakPtr(const SharedPtr<Y, Policy>& other_ptr)
+    : ptr_counter_(other_ptr.get_ptr_counter()),
+      ptr_(other_ptr.get()) {
+  if (ptr_counter_) {
+    ptr_counter_->increment_weak_count();
+  }
 }
 
-template <typename T>
-bool WeakPtr<T>::expired() {
+template <typename T, typename Policy>
+bool WeakPtr<T, Policy>::expired() {
   return static_cast<bool>(!ptr_counter_ ||
                            !(ptr_counter_->get_shared_count()));
 }
 
-template <typename T>
-typename SharedPtr<T>::BasePtrCounter* WeakPtr<T>::lock() {
-  return expired()
-             ? std::runtime_error("Попытка обратиться по устарелой ссылке")
-             : ptr_counter_;
+template <typename T, typename Policy>
+SharedPtr<T, Policy> WeakPtr<T, Policy>::lock() const {
+  SharedPtr<T, Policy> locked = try_lock();
+  if (!locked.get_ptr_counter()) {
+    throw std::runtime_error("Попытка обратиться по устарелой ссылке");
+  }
+  return locked;
 }
 
-template <typename T>
-template <typename Y>
-const WeakPtr<T>& WeakPtr<T>::operator=(const WeakPtr<Y>& other_ptr) {
+template <typename T, typename Policy>
+SharedPtr<T, Policy> WeakPtr<T, Policy>::try_lock() const {
+  if (!ptr_counter_ || !ptr_counter_->increment_shared_count_if_nonzero()) {
+    return SharedPtr<T, Policy>();
+  }
+  return SharedPtr<T, Policy>(ptr_counter_, ptr_);
+}
+
+template <typename T, typename Policy>
+const WeakPtr<T, Policy>& WeakPtr<T, Policy>::operator=(
+    const WeakPtr& other_ptr) {
   if (this != &other_ptr) {
-    reinterpret_cast<typename SharedPtr<T>::BasePtrCounter*>(
-        other_ptr.get_ptr_counter())
-        ->increment_weak_count();
-    this->~WeakPtr();
+    if (other_ptr.ptr_counter_) {
+      other_ptr.ptr_counter_->increment_weak_count();
+    }
+    release();
+    ptr_counter_ = other_ptr.ptr_counter_;
+    ptr_ = other_ptr.ptr_;
   }
   return *this;
 }
 
-template <typename T>
-template <typename Y>
-WeakPtr<T>& WeakPtr<T>::operator=(WeakPtr<Y>&& other_ptr) {
+template <typename T, typename Policy>
+WeakPtr<T, Policy>& WeakPtr<T, Policy>::operator=(WeakPtr&& other_ptr) {
   if (this != &other_ptr) {
-    if (ptr_counter_ && ptr_counter_->get_weak_count() > 0) {
-      ptr_counter_->decrement_weak_count();
-      if (ptr_counter_->get_weak_count() == 0 &&
-          ptr_counter_->get_shared_count() == 0) {
-        ptr_counter_->deallocate();
-      }
-    }
-    ptr_counter_ = other_ptr.get_ptr_counter();
-    other_ptr.reset_ptr_counter();
+    release();
+    ptr_counter_ = other_ptr.ptr_counter_;
+    ptr_ = other_ptr.ptr_;
+    other_ptr.ptr_counter_ = nullptr;
+    other_ptr.ptr_ = nullptr;
+  }
+  return *this;
+}
+
+template <typename T, typename Policy>
+template <typename Y>
+const WeakPtr<T, Policy>& WeakPtr<T, Policy>::operator=(
+    const WeakPtr<Y, Policy>& other_ptr) {
+  element_type* ptr = converted(other_ptr);
+  if (other_ptr.ptr_counter_) {
+    other_ptr.ptr_counter_->increment_weak_count();
   }
+  release();
+  ptr_counter_ = other_ptr.ptr_counter_;
+  ptr_ = ptr;
+  return *this;
+}
+
+template <typename T, typename Policy>
+template <typename Y>
+WeakPtr<T, Policy>& WeakPtr<T, Policy>::operator=(
+    WeakPtr<Y, Policy>&& other_ptr) {
+  element_type* ptr = converted(other_ptr);
+  release();
+  ptr_counter_ = other_ptr.ptr_counter_;
+  ptr_ = ptr;
+  other_ptr.ptr_counter_ = nullptr;
+  other_ptr.ptr_ = nullptr;
   return *this;
 }
 
-template <typename T>
-WeakPtr<T>::~WeakPtr() {
+template <typename T, typename Policy>
+void WeakPtr<T, Policy>::release() {
   if (ptr_counter_) {
-    if (ptr_counter_->get_weak_count() > 0) {
-      ptr_counter_->decrement_weak_count();
+    ptr_counter_->release_weak();
+  }
+}
+
+template <typename T, typename Policy>
+WeakPtr<T, Policy>::~WeakPtr() {
+  release();
+}
+
+template <typename T, typename Policy>
+template <typename Y>
+bool SharedPtr<T, Policy>::owner_before(
+    const SharedPtr<Y, Policy>& other_ptr) const {
+  return std::less<const void*>()(ptr_counter_, other_ptr.get_ptr_counter());
+}
+
+template <typename T, typename Policy>
+template <typename Y>
+bool SharedPtr<T, Policy>::owner_before(
+    const WeakPtr<Y, Policy>& other_ptr) const {
+  return std::less<const void*>()(ptr_counter_, other_ptr.get_ptr_counter());
+}
+
+template <typename T, typename Policy>
+template <typename Y>
+bool WeakPtr<T, Policy>::owner_before(
+    const SharedPtr<Y, Policy>& other_ptr) const {
+  return std::less<const void*>()(ptr_counter_, other_ptr.get_ptr_counter());
+}
+
+template <typename T, typename Policy>
+template <typename Y>
+bool WeakPtr<T, Policy>::owner_before(
+    const WeakPtr<Y, Policy>& other_ptr) const {
+  return std::less<const void*>()(ptr_counter_, other_ptr.get_ptr_counter());
+}
+
+// The control block of ptr, for slots that store nothing else and get the
+// pointer back from the block. Throws std::invalid_argument if ptr is
+// aliased, that is, points elsewhere than the block's own object.
+template <typename T, typename Policy>
+ControlBlock<Policy>* CheckedCounter(const SharedPtr<T, Policy>& ptr) {
+  ControlBlock<Policy>* counter = ptr.get_ptr_counter();
+  if (counter && counter->get_ptr() != ptr.get()) {
+    throw std::invalid_argument(
+        "SharedPtr с алиасом нельзя хранить одним счётчиком");
+  }
+  return counter;
+}
+
+// The finalizer of SplitMix64: spreads every bit of the input over the
+// whole result, so that any slice of it can pick a bucket.
+inline size_t MixHash(uint64_t bits) {
+  bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebULL;
+  return static_cast<size_t>(bits ^ (bits >> 31));
+}
+
+// Hash of a pointer for power-of-two tables. Control blocks are aligned and
+// come from a few slabs, so the low bits are constant and the high ones
+// barely vary.
+inline size_t HashPointer(const void* ptr) {
+  return MixHash(reinterpret_cast<uintptr_t>(ptr));
+}
+
+// Hash and equality by control block, for maps keyed on object identity.
+// A WeakPtr key hashes the same before and after its object dies, and
+// neither needs to lock it. Both accept SharedPtrs too and are marked
+// transparent, but unordered containers honour that only from C++20: in
+// C++17, find() on a map keyed on WeakPtrs turns a SharedPtr into a
+// temporary WeakPtr, at the cost of a weak count increment and decrement.
+struct OwnerHash {
+  using is_transparent = void;
+
+  template <typename T, typename Policy>
+  size_t operator()(const SharedPtr<T, Policy>& ptr) const {
+    return HashPointer(ptr.get_ptr_counter());
+  }
+
+  template <typename T, typename Policy>
+  size_t operator()(const WeakPtr<T, Policy>& ptr) const {
+    return HashPointer(ptr.get_ptr_counter());
+  }
+};
+
+struct OwnerEqual {
+  using is_transparent = void;
+
+  template <typename Left, typename Right>
+  bool operator()(const Left& left, const Right& right) const {
+    return static_cast<const void*>(left.get_ptr_counter()) ==
+           static_cast<const void*>(right.get_ptr_counter());
+  }
+};
+
+// Base for objects that need SharedPtrs to themselves. When SharedPtr(Y*),
+// MakeShared or MakeSharedBatch takes an object derived from
+// EnableSharedFromThis<T>, the WeakPtr embedded here is pointed at the new
+// control block, with no allocation of its own. shared_from_this() then
+// costs one compare-and-swap on the shared count. It throws
+// std::runtime_error while no SharedPtr owns the object, which includes
+// the object's constructor and destructor.
+template <typename T, typename Policy = MultiThreadPolicy>
+class EnableSharedFromThis {
+ public:
+  SharedPtr<T, Policy> shared_from_this() { return weak_this_.lock(); }
+
+  WeakPtr<T, Policy> weak_from_this() { return weak_this_; }
+
+ protected:
+  EnableSharedFromThis() {}
+
+  // A copy is a different object, owned separately if at all.
+  EnableSharedFromThis(const EnableSharedFromThis&) {}
+
+  EnableSharedFromThis& operator=(const EnableSharedFromThis&) {
+    return *this;
+  }
+
+  ~EnableSharedFromThis() = default;
+
+ private:
+  template <typename Y, typename OtherPolicy>
+  friend class SharedPtr;
+
+  WeakPtr<T, Policy> weak_this_;
+};
+
+template <typename T, typename Policy>
+template <typename Y>
+void SharedPtr<T, Policy>::link_shared_from_this(Y* ptr) const {
+  using Base = SharedFromThisBase<Y>;
+  if constexpr (!std::is_array_v<T> && !std::is_void_v<Base>) {
+    if (!ptr || !ptr_counter_) {
+      return;
+    }
+    auto* object = const_cast<std::remove_cv_t<Y>*>(ptr);
+    Base* base = object;
+    if (base->weak_this_.expired()) {
+      using Weak = decltype(base->weak_this_);
+      base->weak_this_ = Weak(
+          ptr_counter_, static_cast<typename Weak::element_type*>(object));
+    }
+  }
+}
+
+template <typename T, typename Policy>
+template <typename Y>
+void SharedPtr<T, Policy>::unlink_shared_from_this(Y* ptr) {
+  using Base = SharedFromThisBase<Y>;
+  if constexpr (!std::is_void_v<Base>) {
+    Base* base = const_cast<std::remove_cv_t<Y>*>(ptr);
+    base->weak_this_ = decltype(base->weak_this_)();
+  }
+}
+
+// How many entries ahead LockAll prefetches control blocks.
+constexpr size_t kLockAllPrefetchDistance = 8;
+
+inline void PrefetchForWrite(const void* address) {
+#if defined(__GNUC__)
+  __builtin_prefetch(address, 1);
+#else
+  (void)address;
+#endif
+}
+
+// Appends to out a SharedPtr for every one of count weak_ptrs whose object
+// is alive and returns how many there were. The control blocks are
+// prefetched a few entries ahead, so walking a long list of observers does
+// not stall on each one in turn. With compact set, the live entries are
+// moved to the front of weak_ptrs in order and the rest are emptied.
+template <typename T, typename Policy>
+size_t LockAll(WeakPtr<T, Policy>* weak_ptrs, size_t count,
+               std::vector<SharedPtr<T, Policy>>& out, bool compact = false) {
+  out.reserve(out.size() + count);
+  size_t alive = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (i + kLockAllPrefetchDistance < count) {
+      PrefetchForWrite(
+          weak_ptrs[i + kLockAllPrefetchDistance].get_ptr_counter());
+    }
+    SharedPtr<T, Policy> locked = weak_ptrs[i].try_lock();
+    if (!locked.get_ptr_counter()) {
+      continue;
+    }
+    out.push_back(std::move(locked));
+    if (compact && alive != i) {
+      weak_ptrs[alive] = std::move(weak_ptrs[i]);
+    }
+    ++alive;
+  }
+  if (compact) {
+    for (size_t i = alive; i < count; ++i) {
+      weak_ptrs[i] = WeakPtr<T, Policy>();
+    }
+  }
+  return alive;
+}
+
+// Same, and with compact set the expired entries are erased.
+template <typename T, typename Policy>
+size_t LockAll(std::vector<WeakPtr<T, Policy>>& weak_ptrs,
+               std::vector<SharedPtr<T, Policy>>& out, bool compact = false) {
+  size_t alive = LockAll(weak_ptrs.data(), weak_ptrs.size(), out, compact);
+  if (compact) {
+    weak_ptrs.resize(alive);
+  }
+  return alive;
+}
+
+// Allocates the counter and the object together from (a rebound copy of)
+// allocator_obj, which is kept in the counter to free them. For T = U[] the
+// arguments are the length and optionally a value to copy into every
+// element. Layout is PackedLayout or CacheLineLayout.
+template <typename T, typename Policy = MultiThreadPolicy,
+          typename Layout = PackedLayout, typename Alloc, typename... Args>
+SharedPtr<T, Policy> AllocateShared(const Alloc& allocator_obj,
+                                    Args&&... args) {
+  using BasePtrCounter = typename SharedPtr<T, Policy>::BasePtrCounter;
+  if constexpr (std::is_array_v<T> && std::extent_v<T> == 0) {
+    using ElementAllocator = typename std::allocator_traits<
+        Alloc>::template rebind_alloc<std::remove_extent_t<T>>;
+    using Counter = typename SharedPtr<T, Policy>::template ArrayPtrCounter<
+        ElementAllocator, Layout>;
+    return SharedPtr<T, Policy>(
+        typename SharedPtr<T, Policy>::AdoptRef(),
+        static_cast<BasePtrCounter*>(
+            Counter::create(ElementAllocator(allocator_obj), args...)));
+  } else {
+    using ObjectAllocator =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+    using Counter = typename SharedPtr<T, Policy>::template NonDirectPtrCounter<
+        ObjectAllocator, Layout>;
+    using CounterAllocator = typename Counter::CounterAllocator;
+
+    ObjectAllocator object_allocator(allocator_obj);
+    CounterAllocator allocator(allocator_obj);
+
+    Counter* temp_ptr =
+        std::allocator_traits<CounterAllocator>::allocate(allocator, 1);
+
+    try {
+      std::allocator_traits<CounterAllocator>::construct(
+          allocator, temp_ptr, object_allocator, std::forward<Args>(args)...);
+    } catch (...) {
+      std::allocator_traits<CounterAllocator>::deallocate(allocator, temp_ptr,
+                                                          1);
+      throw;
     }
-    if (ptr_counter_->get_weak_count() == 0 &&
-        ptr_counter_->get_shared_count() == 0) {
-      ptr_counter_->deallocate();
+
+    SharedPtr<T, Policy> result(typename SharedPtr<T, Policy>::AdoptRef(),
+                                static_cast<BasePtrCounter*>(temp_ptr));
+    result.link_shared_from_this(result.get());
+    return result;
+  }
+}
+
+template <typename T, typename Policy = MultiThreadPolicy,
+          typename Layout = PackedLayout, typename... Args>
+SharedPtr<T, Policy> MakeShared(Args&&... args) {
+  return AllocateShared<T, Policy, Layout>(
+      std::allocator<std::remove_extent_t<T>>(), std::forward<Args>(args)...);
+}
+
+// Like AllocateShared, but default-initializes the object, so trivially
+// constructible payloads such as receive buffers are left unzeroed.
+template <typename T, typename Policy = MultiThreadPolicy,
+          typename Layout = PackedLayout, typename Alloc>
+SharedPtr<T, Policy> AllocateSharedForOverwrite(const Alloc& allocator_obj) {
+  static_assert(!std::is_array_v<T> || std::extent_v<T> != 0,
+                "U[] needs a length");
+  return AllocateShared<T, Policy, Layout>(
+      allocator_obj, typename SharedPtr<T, Policy>::ForOverwrite());
+}
+
+template <typename T, typename Policy = MultiThreadPolicy,
+          typename Layout = PackedLayout, typename Alloc>
+SharedPtr<T, Policy> AllocateSharedForOverwrite(const Alloc& allocator_obj,
+                                                size_t length) {
+  static_assert(std::is_array_v<T> && std::extent_v<T> == 0,
+                "Only U[] takes a length");
+  return AllocateShared<T, Policy, Layout>(
+      allocator_obj, length, typename SharedPtr<T, Policy>::ForOverwrite());
+}
+
+template <typename T, typename Policy = MultiThreadPolicy,
+          typename Layout = PackedLayout>
+SharedPtr<T, Policy> MakeSharedForOverwrite() {
+  return AllocateSharedForOverwrite<T, Policy, Layout>(
+      std::allocator<std::remove_extent_t<T>>());
+}
+
+template <typename T, typename Policy = MultiThreadPolicy,
+          typename Layout = PackedLayout>
+SharedPtr<T, Policy> MakeSharedForOverwrite(size_t length) {
+  return AllocateSharedForOverwrite<T, Policy, Layout>(
+      std::allocator<std::remove_extent_t<T>>(), length);
+}
+
+// Builds count objects, the i-th from factory(i), each with counts of its
+// own but all in one allocation from (a rebound copy of) allocator_obj. The
+// allocation is returned after the last of the objects dies, so a single
+// long-lived object keeps the whole batch's memory.
+template <typename T, typename Policy = MultiThreadPolicy, typename Alloc,
+          typename Factory>
+std::vector<SharedPtr<T, Policy>> AllocateSharedBatch(
+    const Alloc& allocator_obj, size_t count, Factory&& factory) {
+  using ObjectAllocator =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+  using Counter = typename SharedPtr<T, Policy>::template BatchPtrCounter<
+      ObjectAllocator>;
+  std::vector<SharedPtr<T, Policy>> batch;
+  Counter::create(ObjectAllocator(allocator_obj), count, factory, batch);
+  return batch;
+}
+
+template <typename T, typename Policy = MultiThreadPolicy, typename Factory>
+std::vector<SharedPtr<T, Policy>> MakeSharedBatch(size_t count,
+                                                  Factory&& factory) {
+  return AllocateSharedBatch<T, Policy>(std::allocator<T>(), count, factory);
+}
+
+// One-word SharedPtr for objects created by MakeShared: the object sits at a
+// fixed offset inside NonDirectPtrCounter, so only the counter is stored.
+template <typename T, typename Policy = MultiThreadPolicy>
+class ThinSharedPtr {
+ public:
+  using element_type = typename SharedPtr<T, Policy>::element_type;
+  using NonDirectPtrCounter =
+      typename SharedPtr<T, Policy>::template NonDirectPtrCounter<>;
+
+  ThinSharedPtr();
+
+  // Both throw std::invalid_argument unless other_ptr is empty or owns and
+  // points to an object created by MakeShared.
+  explicit ThinSharedPtr(const SharedPtr<T, Policy>& other_ptr);
+
+  explicit ThinSharedPtr(SharedPtr<T, Policy>&& other_ptr);
+
+  ThinSharedPtr(const ThinSharedPtr& other_ptr);
+
+  ThinSharedPtr(ThinSharedPtr&& other_ptr);
+
+  const ThinSharedPtr& operator=(const ThinSharedPtr& other_ptr);
+
+  const ThinSharedPtr& operator=(ThinSharedPtr&& other_ptr);
+
+  element_type* get() const;
+
+  element_type& operator*() const;
+
+  element_type* operator->() const;
+
+  uint32_t use_count() const;
+
+  void reset();
+
+  SharedPtr<T, Policy> to_shared() const&;
+
+  // Hands the reference over without touching the count.
+  SharedPtr<T, Policy> to_shared() &&;
+
+  ~ThinSharedPtr();
+
+ private:
+  static NonDirectPtrCounter* counter_of(
+      const SharedPtr<T, Policy>& other_ptr);
+
+  void release();
+
+  NonDirectPtrCounter* ptr_counter_;
+};
+
+template <typename T, typename Policy>
+ThinSharedPtr<T, Policy>::ThinSharedPtr() : ptr_counter_(nullptr) {}
+
+template <typename T, typename Policy>
+ThinSharedPtr<T, Policy>::ThinSharedPtr(const SharedPtr<T, Policy>& other_ptr)
+    : ptr_counter_(counter_of(other_ptr)) {
+  if (ptr_counter_) {
+    ptr_counter_->increment_shared_count();
+  }
+}
+
+template <typename T, typename Policy>
+ThinSharedPtr<T, Policy>::ThinSharedPtr(SharedPtr<T, Policy>&& other_ptr)
+    : ptr_counter_(counter_of(other_ptr)) {
+  other_ptr.reset_ptr_counter();
+  other_ptr.reset_ptr();
+}
+
+template <typename T, typename Policy>
+ThinSharedPtr<T, Policy>::ThinSharedPtr(const ThinSharedPtr& other_ptr)
+    : ptr_counter_(other_ptr.ptr_counter_) {
+  if (ptr_counter_) {
+    ptr_counter_->increment_shared_count();
+  }
+}
+
+template <typename T, typename Policy>
+ThinSharedPtr<T, Policy>::ThinSharedPtr(ThinSharedPtr&& other_ptr)
+    : ptr_counter_(other_ptr.ptr_counter_) {
+  other_ptr.ptr_counter_ = nullptr;
+}
+
+template <typename T, typename Policy>
+const ThinSharedPtr<T, Policy>& ThinSharedPtr<T, Policy>::operator=(
+    const ThinSharedPtr& other_ptr) {
+  if (this != &other_ptr) {
+    if (other_ptr.ptr_counter_) {
+      other_ptr.ptr_counter_->increment_shared_count();
     }
+    release();
+    ptr_counter_ = other_ptr.ptr_counter_;
+  }
+  return *this;
+}
+
+template <typename T, typename Policy>
+const ThinSharedPtr<T, Policy>& ThinSharedPtr<T, Policy>::operator=(
+    ThinSharedPtr&& other_ptr) {
+  if (this != &other_ptr) {
+    release();
+    ptr_counter_ = other_ptr.ptr_counter_;
+    other_ptr.ptr_counter_ = nullptr;
   }
+  return *this;
+}
+
+template <typename T, typename Policy>
+typename ThinSharedPtr<T, Policy>::element_type* ThinSharedPtr<T, Policy>::get()
+    const {
+  return ptr_counter_ ? ptr_counter_->get_ptr() : nullptr;
+}
+
+template <typename T, typename Policy>
+typename ThinSharedPtr<T, Policy>::element_type&
+ThinSharedPtr<T, Policy>::operator*() const {
+  return *ptr_counter_->get_ptr();
 }
 
-template <typename T, typename... Args>
-SharedPtr<T> MakeShared(Args&&... args) {
-  std::allocator<typename SharedPtr<T>::NonDirectPtrCounter> allocator;
+template <typename T, typename Policy>
+typename ThinSharedPtr<T, Policy>::element_type*
+ThinSharedPtr<T, Policy>::operator->() const {
+  return ptr_counter_->get_ptr();
+}
+
+template <typename T, typename Policy>
+uint32_t ThinSharedPtr<T, Policy>::use_count() const {
+  return ptr_counter_ ? ptr_counter_->get_shared_count() : 0;
+}
+
+template <typename T, typename Policy>
+void ThinSharedPtr<T, Policy>::reset() {
+  release();
+  ptr_counter_ = nullptr;
+}
+
+template <typename T, typename Policy>
+SharedPtr<T, Policy> ThinSharedPtr<T, Policy>::to_shared() const& {
+  return ThinSharedPtr(*this).to_shared();
+}
 
-  typename SharedPtr<T>::NonDirectPtrCounter* temp_ptr =
-      std::allocator_traits<std::allocator<
-          typename SharedPtr<T>::NonDirectPtrCounter>>::allocate(allocator, 1);
+template <typename T, typename Policy>
+SharedPtr<T, Policy> ThinSharedPtr<T, Policy>::to_shared() && {
+  typename SharedPtr<T, Policy>::BasePtrCounter* ptr_counter = ptr_counter_;
+  ptr_counter_ = nullptr;
+  return SharedPtr<T, Policy>(typename SharedPtr<T, Policy>::AdoptRef(),
+                              ptr_counter);
+}
+
+template <typename T, typename Policy>
+ThinSharedPtr<T, Policy>::~ThinSharedPtr() {
+  release();
+}
 
-  std::allocator_traits<
-      std::allocator<typename SharedPtr<T>::NonDirectPtrCounter>>::
-      construct(allocator, temp_ptr, std::forward<Args>(args)...);
+template <typename T, typename Policy>
+typename ThinSharedPtr<T, Policy>::NonDirectPtrCounter*
+ThinSharedPtr<T, Policy>::counter_of(const SharedPtr<T, Policy>& other_ptr) {
+  typename SharedPtr<T, Policy>::BasePtrCounter* ptr_counter =
+      other_ptr.get_ptr_counter();
+  if (!ptr_counter) {
+    return nullptr;
+  }
+  if (!ptr_counter->template is_a<NonDirectPtrCounter>() ||
+      static_cast<NonDirectPtrCounter*>(ptr_counter)->get_ptr() !=
+          other_ptr.get()) {
+    throw std::invalid_argument("SharedPtr создан не через MakeShared");
+  }
+  return static_cast<NonDirectPtrCounter*>(ptr_counter);
+}
 
-  SharedPtr<T> ptr(temp_ptr);
-  return std::move(ptr);
+template <typename T, typename Policy>
+void ThinSharedPtr<T, Policy>::release() {
+  if (ptr_counter_) {
+    ptr_counter_->release_shared();
+  }
 }
\ No newline at end of file
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "concurrency.hpp"
+#include "smart_pointers.hpp"
+
+// Epoch-based read-side sections for Snapshot. A reader copies the global
+// epoch into a record of its own on entry and clears it on exit, so
+// reading writes to nothing shared. A version replaced at epoch E may be
+// released once every record is clear or past E: anyone who entered later
+// sees the replacement.
+class EpochDomain {
+ public:
+  struct alignas(kCacheLineSize) Record {
+    // 0 outside a read-side section.
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> active{false};
+    Record* next = nullptr;
+    // Nesting depth, touched by the owner thread only.
+    uint32_t depth = 0;
+  };
+
+  static EpochDomain& instance() {
+    static EpochDomain* domain = new EpochDomain;
+    return *domain;
+  }
+
+  void enter() {
+    Record* record = current();
+    if (record->depth++ == 0) {
+      record->epoch.store(epoch_.load(std::memory_order_relaxed),
+                          std::memory_order_seq_cst);
+    }
+  }
+
+  void exit() {
+    Record* record = current();
+    if (--record->depth == 0) {
+      record->epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  // Starts a new epoch and returns the one that ended: versions replaced
+  // before the call are released once safe_to_release() is past it.
+  uint64_t advance() {
+    return epoch_.fetch_add(1, std::memory_order_seq_cst);
+  }
+
+  // Every version retired at an epoch below the result is unreachable.
+  uint64_t safe_to_release() const;
+
+ private:
+  struct ThreadHandle {
+    ThreadHandle() : record(EpochDomain::instance().records_.acquire()) {}
+
+    ~ThreadHandle() {
+      current_ = nullptr;
+      RecordRegistry<Record>::release(record);
+    }
+
+    Record* record;
+  };
+
+  EpochDomain() = default;
+
+  // A thread past its handle's destruction gets a record of its own that
+  // it keeps.
+  Record* current() {
+    if (!current_) {
+      if (exited_) {
+        current_ = records_.acquire();
+      } else {
+        thread_local ThreadHandle handle;
+        exited_ = true;
+        current_ = handle.record;
+      }
+    }
+    return current_;
+  }
+
+  static inline thread_local Record* current_ = nullptr;
+  // Set once the thread's handle exists, so that current() does not bring
+  // it back to life after its destruction.
+  static inline thread_local bool exited_ = false;
+
+  // Starts at 1 so that 0 can mean "not reading".
+  std::atomic<uint64_t> epoch_{1};
+  RecordRegistry<Record> records_;
+};
+
+inline uint64_t EpochDomain::safe_to_release() const {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  uint64_t oldest = epoch_.load(std::memory_order_seq_cst);
+  for (Record* record = records_.head(); record; record = record->next) {
+    uint64_t epoch = record->epoch.load(std::memory_order_seq_cst);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+  return oldest;
+}
+
+// A published version of T that readers access inside a read-side section,
+// without touching its counts, while writers publish replacements. A
+// replaced version keeps the snapshot's shared reference until every
+// section that might have seen it has ended, and is then released through
+// the usual destroy/deallocate path.
+template <typename T, typename Policy = MultiThreadPolicy>
+class Snapshot {
+ public:
+  // A read-side section: the version it shows stays alive until the guard
+  // is destroyed. Guards nest and must be destroyed on the thread that
+  // created them.
+  class ReadGuard {
+   public:
+    ReadGuard(const ReadGuard&) = delete;
+
+    ReadGuard& operator=(const ReadGuard&) = delete;
+
+    const T* get() const { return ptr_; }
+
+    const T& operator*() const { return *ptr_; }
+
+    const T* operator->() const { return ptr_; }
+
+    ~ReadGuard() { EpochDomain::instance().exit(); }
+
+   private:
+    friend class Snapshot;
+
+    explicit ReadGuard(const Snapshot& snapshot) {
+      EpochDomain::instance().enter();
+      BasePtrCounter* counter =
+          snapshot.current_.load(std::memory_order_seq_cst);
+      ptr_ = counter ? static_cast<const T*>(counter->get_ptr()) : nullptr;
+    }
+
+    const T* ptr_;
+  };
+
+  Snapshot() : current_(nullptr) {}
+
+  explicit Snapshot(SharedPtr<T, Policy> initial)
+      : current_(adopt(std::move(initial))) {}
+
+  Snapshot(const Snapshot&) = delete;
+
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  ReadGuard read() const { return ReadGuard(*this); }
+
+  // A shared reference to the current version, for keeping it past a
+  // section.
+  SharedPtr<T, Policy> load() const;
+
+  void publish(SharedPtr<T, Policy> version);
+
+  template <typename... Args>
+  void emplace(Args&&... args) {
+    publish(MakeShared<T, Policy>(std::forward<Args>(args)...));
+  }
+
+  // Releases the replaced versions no section can still see. Returns how
+  // many it released.
+  size_t reclaim();
+
+  // Waits until every version replaced so far is released. Must not be
+  // called from inside a read-side section.
+  void synchronize();
+
+  // No section may still be reading from the snapshot.
+  ~Snapshot();
+
+ private:
+  static_assert(!std::is_array_v<T>, "Snapshot holds single objects");
+
+  using BasePtrCounter = typename SharedPtr<T, Policy>::BasePtrCounter;
+
+  struct Retired {
+    BasePtrCounter* counter;
+    uint64_t epoch;
+  };
+
+  static BasePtrCounter* adopt(SharedPtr<T, Policy> version) {
+    BasePtrCounter* counter = CheckedCounter(version);
+    version.reset_ptr_counter();
+    version.reset_ptr();
+    return counter;
+  }
+
+  std::atomic<BasePtrCounter*> current_;
+  std::mutex mutex_;
+  std::vector<Retired> retired_;
+};
+
+template <typename T, typename Policy>
+SharedPtr<T, Policy> Snapshot<T, Policy>::load() const {
+  EpochDomain::instance().enter();
+  BasePtrCounter* counter = current_.load(std::memory_order_seq_cst);
+  if (!counter) {
+    EpochDomain::instance().exit();
+    return SharedPtr<T, Policy>();
+  }
+  counter->increment_shared_count();
+  EpochDomain::instance().exit();
+  return SharedPtr<T, Policy>(typename SharedPtr<T, Policy>::AdoptRef(),
+                              counter);
+}
+
+template <typename T, typename Policy>
+void Snapshot<T, Policy>::publish(SharedPtr<T, Policy> version) {
+  BasePtrCounter* counter =
+      current_.exchange(adopt(std::move(version)), std::memory_order_seq_cst);
+  if (counter) {
+    uint64_t epoch = EpochDomain::instance().advance();
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired_.push_back(Retired{counter, epoch});
+  }
+  reclaim();
+}
+
+// Releasing runs destructors, which may publish, so the lock is not held
+// meanwhile.
+template <typename T, typename Policy>
+size_t Snapshot<T, Policy>::reclaim() {
+  uint64_t safe = EpochDomain::instance().safe_to_release();
+  std::vector<Retired> released;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t kept = 0;
+    for (const Retired& entry : retired_) {
+      if (entry.epoch < safe) {
+        released.push_back(entry);
+      } else {
+        retired_[kept++] = entry;
+      }
+    }
+    retired_.resize(kept);
+  }
+  for (const Retired& entry : released) {
+    entry.counter->release_shared();
+  }
+  return released.size();
+}
+
+template <typename T, typename Policy>
+void Snapshot<T, Policy>::synchronize() {
+  while (true) {
+    reclaim();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (retired_.empty()) {
+        return;
+      }
+    }
+    std::this_thread::yield();
+  }
+}
+
+template <typename T, typename Policy>
+Snapshot<T, Policy>::~Snapshot() {
+  for (const Retired& entry : retired_) {
+    entry.counter->release_shared();
+  }
+  if (BasePtrCounter* counter = current_.load(std::memory_order_relaxed)) {
+    counter->release_shared();
+  }
+}
@@ -0,0 +1,145 @@
+// AtomicSharedPtr: prepaid references and refills, exchange and
+// compare_exchange, rejection of aliased SharedPtrs, the limit on slots per
+// object, and readers racing writers.
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../atomic_shared_ptr.hpp"
+
+namespace {
+
+struct Config {
+  static inline std::atomic<int> live{0};
+
+  explicit Config(int config_value) : value(config_value) { ++live; }
+
+  ~Config() { --live; }
+
+  int value;
+};
+
+void TestOperations() {
+  AtomicSharedPtr<Config> slot(MakeShared<Config>(1));
+  // More loads than the slot prepays, so it refills several times.
+  for (int i = 0; i < 100000; ++i) {
+    assert(slot.load()->value == 1);
+  }
+  SharedPtr<Config> kept = slot.load();
+  SharedPtr<Config> old = slot.exchange(MakeShared<Config>(2));
+  assert(old.get() == kept.get() && old.use_count() == 2);
+  old.reset();
+  kept.reset();
+  assert(Config::live == 1);
+
+  SharedPtr<Config> current = slot.load();
+  SharedPtr<Config> wrong = MakeShared<Config>(9);
+  assert(!slot.compare_exchange_strong(wrong, MakeShared<Config>(3)));
+  assert(wrong.get() == current.get());
+  assert(slot.compare_exchange_strong(current, MakeShared<Config>(4)));
+  assert(slot.load()->value == 4);
+  slot.store(SharedPtr<Config>());
+  assert(!slot.load().get());
+  SharedPtr<Config> empty;
+  while (!slot.compare_exchange_weak(empty, MakeShared<Config>(5))) {
+  }
+  assert(slot.load()->value == 5);
+}
+
+struct Pair {
+  Config first{7};
+  Config second{8};
+};
+
+void TestAliasingRejected() {
+  AtomicSharedPtr<Config> slot;
+  auto pair = MakeShared<Pair>();
+  bool threw = false;
+  try {
+    slot.store(SharedPtr<Config>(pair, &pair->second));
+  } catch (const std::invalid_argument&) {
+    threw = true;
+  }
+  assert(threw && pair.use_count() == 1);
+}
+
+// Every slot prepays into the block's 32-bit shared count, so the number of
+// slots holding one block is bounded.
+void TestSlotLimit() {
+  auto shared = MakeShared<Config>(1);
+  std::vector<AtomicSharedPtr<Config>> slots(1 << 18);
+  size_t filled = 0;
+  bool threw = false;
+  try {
+    for (; filled < slots.size(); ++filled) {
+      slots[filled].store(shared);
+    }
+  } catch (const std::overflow_error&) {
+    threw = true;
+  }
+  assert(threw && filled > (1 << 18) - 4);
+  assert(!slots[filled].load().get());
+  SharedPtr<Config> empty;
+  threw = false;
+  try {
+    slots[filled].compare_exchange_strong(empty, shared);
+  } catch (const std::overflow_error&) {
+    threw = true;
+  }
+  assert(threw && !slots[filled].load().get());
+  slots.clear();
+  assert(shared.use_count() == 1);
+}
+
+void TestReadersAndWriters() {
+  AtomicSharedPtr<Config> slot(MakeShared<Config>(0));
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; ++t) {
+    readers.emplace_back([&] {
+      while (!stop.load(std::memory_order_relaxed)) {
+        SharedPtr<Config> config = slot.load();
+        assert(config.get() && config->value >= 0);
+      }
+    });
+  }
+  std::thread storer([&] {
+    for (int i = 0; i < 20000; ++i) {
+      slot.store(MakeShared<Config>(i));
+    }
+  });
+  std::thread swapper([&] {
+    for (int i = 0; i < 20000; ++i) {
+      SharedPtr<Config> expected = slot.load();
+      slot.compare_exchange_strong(expected, MakeShared<Config>(i));
+    }
+  });
+  storer.join();
+  swapper.join();
+  stop = true;
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+}
+
+}  // namespace
+
+int main() {
+  static_assert(AtomicSharedPtr<int>::is_always_lock_free);
+  TestOperations();
+  TestAliasingRejected();
+  TestSlotLimit();
+  TestReadersAndWriters();
+  {
+    AtomicSharedPtr<Config, DeferredPolicy> deferred(
+        MakeShared<Config, DeferredPolicy>(1));
+    deferred.store(MakeShared<Config, DeferredPolicy>(2));
+  }
+  DrainDeferred();
+  assert(Config::live == 0);
+  std::puts("ok");
+}
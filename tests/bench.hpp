@@ -0,0 +1,67 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+// Keeps the optimizer from dropping a value the benchmark computes.
+template <typename T>
+inline void KeepAlive(const T& value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+// Best of a few runs of body(iterations), in nanoseconds per iteration.
+template <typename Body>
+double MeasureNs(size_t iterations, Body body, int runs = 5) {
+  double best = 1e18;
+  for (int run = 0; run < runs; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    body(iterations);
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count() / iterations);
+  }
+  return best;
+}
+
+// Runs body(iterations) on every thread at once and returns the wall time
+// per iteration per thread, in nanoseconds.
+template <typename Body>
+double MeasureThreadsNs(int threads, size_t iterations, Body body) {
+  std::atomic<int> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&] {
+      ++ready;
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      body(iterations);
+    });
+  }
+  while (ready.load() != threads) {
+    std::this_thread::yield();
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+// Thread counts worth trying on this machine: 1, 2, 4 and every core.
+inline std::vector<int> ThreadCounts() {
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> counts = {1, 2, 4};
+  if (cores > 4) {
+    counts.push_back(cores);
+  }
+  return counts;
+}
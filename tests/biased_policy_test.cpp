@@ -0,0 +1,197 @@
+// BiasedThreadPolicy: owner-only counting, merges queued back to the owner,
+// owners that exit first, weak promotion of dying blocks, and counting on
+// threads past their thread_local destruction.
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "../smart_pointers.hpp"
+
+namespace {
+
+using Policy = BiasedThreadPolicy;
+
+struct Tracked {
+  static inline std::atomic<int> live{0};
+
+  Tracked() { ++live; }
+
+  ~Tracked() { --live; }
+
+  int value = 7;
+};
+
+void TestOwnerOnly() {
+  SharedPtr<Tracked, Policy> first(new Tracked);
+  SharedPtr<Tracked, Policy> second = first;
+  assert(first.use_count() == 2);
+  WeakPtr<Tracked, Policy> weak(first);
+  first.reset();
+  second.reset();
+  assert(Tracked::live == 0 && weak.expired());
+}
+
+void TestForeignCopies() {
+  auto shared = MakeShared<Tracked, Policy>();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([shared] {
+      for (int i = 0; i < 10000; ++i) {
+        SharedPtr<Tracked, Policy> copy = shared;
+        assert(copy->value == 7);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  ProcessBiasedMerges();
+  assert(shared.use_count() == 1);
+  shared.reset();
+  assert(Tracked::live == 0);
+}
+
+// A foreign thread drops the last shared count; the merge is queued to the
+// owner, which finishes the release.
+void TestQueuedMerge() {
+  {
+    auto shared = MakeShared<Tracked, Policy>();
+    SharedPtr<Tracked, Policy> copy = shared;
+    WeakPtr<Tracked, Policy> weak(shared);
+    std::thread([copy = std::move(copy)]() mutable { copy.reset(); }).join();
+    assert(Tracked::live == 1);
+    shared.reset();
+    ProcessBiasedMerges();
+    assert(Tracked::live == 0 && weak.expired());
+  }
+  {
+    auto shared = MakeShared<Tracked, Policy>();
+    SharedPtr<Tracked, Policy> copy = shared;
+    std::thread([copy = std::move(copy)]() mutable { copy.reset(); }).join();
+    ProcessBiasedMerges();
+    assert(shared.use_count() == 1);
+    shared.reset();
+    assert(Tracked::live == 0);
+  }
+}
+
+void TestOwnerExitsFirst() {
+  SharedPtr<Tracked, Policy> out;
+  std::thread([&out] {
+    out = MakeShared<Tracked, Policy>();
+    SharedPtr<Tracked, Policy> copy = out;
+  }).join();
+  assert(Tracked::live == 1);
+  WeakPtr<Tracked, Policy> weak(out);
+  {
+    SharedPtr<Tracked, Policy> locked = weak.lock();
+    assert(locked.use_count() == 2);
+  }
+  out.reset();
+  assert(Tracked::live == 0 && weak.expired());
+}
+
+// Once the counts sum to zero the block is dead even with its merge still
+// queued: neither the owner nor another thread may promote a WeakPtr.
+void TestNoPromotionOfDeadBlocks() {
+  auto shared = MakeShared<Tracked, Policy>();
+  WeakPtr<Tracked, Policy> weak(shared);
+  std::thread([shared = std::move(shared)]() mutable { shared.reset(); })
+      .join();
+  std::thread([&weak] {
+    assert(weak.expired() && !weak.try_lock().get());
+  }).join();
+  assert(weak.expired() && !weak.try_lock().get());
+  assert(Tracked::live == 0);
+
+  auto alive = MakeShared<Tracked, Policy>();
+  SharedPtr<Tracked, Policy> kept = alive;
+  WeakPtr<Tracked, Policy> weak_alive(alive);
+  std::thread([alive = std::move(alive)]() mutable { alive.reset(); }).join();
+  assert(!weak_alive.expired() && weak_alive.try_lock().get() == kept.get());
+  std::thread([&weak_alive] {
+    assert(weak_alive.try_lock().get());
+  }).join();
+  kept.reset();
+  ProcessBiasedMerges();
+  assert(Tracked::live == 0 && weak_alive.expired());
+}
+
+// The owner still holds a reference while the merge of a foreign release
+// waits in its queue, and stays idle: other threads promote all the same.
+void TestPromotionWhileQueued() {
+  auto owner = MakeShared<Tracked, Policy>();
+  WeakPtr<Tracked, Policy> weak(owner);
+  SharedPtr<Tracked, Policy> copy = owner;
+  std::thread([copy = std::move(copy)]() mutable { copy.reset(); }).join();
+  std::thread([&weak] {
+    assert(!weak.expired());
+    SharedPtr<Tracked, Policy> locked = weak.try_lock();
+    assert(locked.get() && weak.lock()->value == 7);
+    locked.reset();
+    assert(!weak.expired());
+  }).join();
+  assert(owner.use_count() == 1);
+  owner.reset();
+  assert(Tracked::live == 0 && weak.expired());
+}
+
+void TestWeakStress() {
+  auto shared = MakeShared<Tracked, Policy>();
+  WeakPtr<Tracked, Policy> weak(shared);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([shared, weak]() mutable {
+      for (int i = 0; i < 10000; ++i) {
+        SharedPtr<Tracked, Policy> locked = weak.try_lock();
+        SharedPtr<Tracked, Policy> copy = shared;
+      }
+      shared.reset();
+    });
+  }
+  shared.reset();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  ProcessBiasedMerges();
+  assert(Tracked::live == 0);
+}
+
+// Runs after the thread's BiasedThreadState is gone, so the blocks it
+// makes fall back to plain atomic counting.
+struct LateUser {
+  ~LateUser() {
+    auto shared = MakeShared<Tracked, Policy>();
+    WeakPtr<Tracked, Policy> weak(shared);
+    SharedPtr<Tracked, Policy> copy = shared;
+    assert(weak.lock().get() == shared.get());
+    assert(shared.use_count() == 2);
+    ProcessBiasedMerges();
+  }
+};
+
+void TestAfterThreadExit() {
+  std::thread([] {
+    thread_local LateUser late;
+    (void)&late;
+    auto shared = MakeShared<Tracked, Policy>();
+  }).join();
+  assert(Tracked::live == 0);
+}
+
+}  // namespace
+
+int main() {
+  TestOwnerOnly();
+  TestForeignCopies();
+  TestQueuedMerge();
+  TestOwnerExitsFirst();
+  TestNoPromotionOfDeadBlocks();
+  TestPromotionWhileQueued();
+  TestWeakStress();
+  TestAfterThreadExit();
+  std::puts("ok");
+}
@@ -0,0 +1,99 @@
+// DeferredPolicy and DeferredReclaimer: explicit draining of long chains,
+// the max_depth bound, metrics and the background worker.
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "../smart_pointers.hpp"
+
+namespace {
+
+using Policy = DeferredPolicy;
+
+struct Node {
+  static inline std::atomic<int> live{0};
+
+  Node() { ++live; }
+
+  ~Node() { --live; }
+
+  SharedPtr<Node, Policy> next;
+};
+
+// Dropping the head of a long list destroys nothing until the queue is
+// drained, and draining does not recurse.
+void TestChain() {
+  auto head = MakeShared<Node, Policy>();
+  SharedPtr<Node, Policy> tail = head;
+  for (int i = 0; i < 1000; ++i) {
+    tail->next = MakeShared<Node, Policy>();
+    tail = tail->next;
+  }
+  tail.reset();
+  WeakPtr<Node, Policy> weak(head);
+  head.reset();
+  assert(Node::live == 1001 && weak.expired());
+  assert(DrainDeferred() == 1001 && Node::live == 0);
+  {
+    SharedPtr<int, Policy> direct(new int(3));
+    SharedPtr<int, Policy> copy = direct;
+  }
+  assert(DrainDeferred() == 1);
+}
+
+void TestMaxDepth() {
+  DeferredReclaimer& reclaimer = DeferredReclaimer::instance();
+  DeferredReclaimer::Metrics before = reclaimer.metrics();
+  reclaimer.set_max_depth(10);
+  {
+    std::vector<SharedPtr<Node, Policy>> nodes;
+    for (int i = 0; i < 20; ++i) {
+      nodes.push_back(MakeShared<Node, Policy>());
+    }
+  }
+  assert(Node::live == 10);
+  DeferredReclaimer::Metrics metrics = reclaimer.metrics();
+  assert(metrics.inline_releases - before.inline_releases == 10);
+  assert(metrics.depth == 10 && metrics.peak_depth >= 10);
+  DrainDeferred();
+  assert(Node::live == 0);
+  reclaimer.set_max_depth(size_t{1} << 16);
+}
+
+void TestWorker() {
+  DeferredReclaimer& reclaimer = DeferredReclaimer::instance();
+  reclaimer.start(std::chrono::milliseconds(1));
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([] {
+      for (int i = 0; i < 5000; ++i) {
+        auto node = MakeShared<Node, Policy>();
+        node->next = MakeShared<Node, Policy>();
+        WeakPtr<Node, Policy> weak(node);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  reclaimer.stop();
+  assert(Node::live == 0);
+  DeferredReclaimer::Metrics metrics = reclaimer.metrics();
+  assert(metrics.deferred == metrics.reclaimed && metrics.depth == 0);
+  std::printf("deferred %llu, max lag %llu us\n",
+              static_cast<unsigned long long>(metrics.deferred),
+              static_cast<unsigned long long>(metrics.max_lag_ns / 1000));
+}
+
+}  // namespace
+
+int main() {
+  TestChain();
+  TestMaxDepth();
+  TestWorker();
+  std::puts("ok");
+}
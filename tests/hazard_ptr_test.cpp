@@ -0,0 +1,101 @@
+// ProtectedSharedPtr and HazardDomain: guarded values outlive their
+// replacement, unguarded ones are released at once, and readers race a
+// writer.
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../hazard_ptr.hpp"
+
+namespace {
+
+struct Config {
+  static inline std::atomic<int> live{0};
+
+  explicit Config(int config_value) : value(config_value) { ++live; }
+
+  ~Config() { --live; }
+
+  int value;
+};
+
+void TestGuards() {
+  ProtectedSharedPtr<Config> slot(MakeShared<Config>(1));
+  slot.store(MakeShared<Config>(2));
+  assert(Config::live == 1);
+  {
+    Guarded<Config> guard = slot.guard();
+    assert(guard->value == 2 && guard.to_shared().use_count() == 2);
+    slot.store(MakeShared<Config>(3));
+    assert(Config::live == 2 && guard->value == 2);
+    Guarded<Config> moved(std::move(guard));
+    assert(!guard.get() && moved->value == 2);
+    assert(slot.guard()->value == 3);
+  }
+  // The guard is gone, so the next store drops the value it kept.
+  slot.store(MakeShared<Config>(4));
+  assert(Config::live == 1);
+  SharedPtr<Config> loaded = slot.load();
+  assert(loaded->value == 4 && loaded.use_count() == 2);
+
+  ProtectedSharedPtr<Config> empty;
+  assert(!empty.guard().get() && !empty.load().get());
+}
+
+struct Pair {
+  Config first{7};
+  Config second{8};
+};
+
+void TestAliasingRejected() {
+  ProtectedSharedPtr<Config> slot;
+  auto pair = MakeShared<Pair>();
+  bool threw = false;
+  try {
+    slot.store(SharedPtr<Config>(pair, &pair->second));
+  } catch (const std::invalid_argument&) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void TestReadersAndWriter() {
+  ProtectedSharedPtr<Config> slot(MakeShared<Config>(0));
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; ++t) {
+    readers.emplace_back([&] {
+      while (!stop.load(std::memory_order_relaxed)) {
+        Guarded<Config> guard = slot.guard();
+        Guarded<Config> nested = slot.guard();
+        assert(guard->value >= 0 && nested->value >= guard->value);
+      }
+    });
+  }
+  for (int i = 1; i < 20000; ++i) {
+    slot.store(MakeShared<Config>(i));
+  }
+  stop = true;
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  // At most the current value and one still pending from the last store.
+  assert(Config::live <= 2);
+  slot.store(MakeShared<Config>(0));
+  assert(Config::live == 1);
+}
+
+}  // namespace
+
+int main() {
+  TestGuards();
+  TestAliasingRejected();
+  TestReadersAndWriter();
+  HazardDomain::instance().reclaim();
+  assert(Config::live == 0);
+  std::puts("ok");
+}
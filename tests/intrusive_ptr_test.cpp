@@ -0,0 +1,101 @@
+// IntrusiveSharedPtr and IntrusiveWeakPtr: one-pointer handles, adoption of
+// raw pointers, the weak companion and weak promotion across threads.
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../intrusive_ptr.hpp"
+
+namespace {
+
+struct Node : RefCounted<Node> {
+  static inline int live = 0;
+
+  explicit Node(int node_value) : value(node_value) { ++live; }
+
+  ~Node() { --live; }
+
+  int value;
+};
+
+struct Observed : WeakRefCounted<Observed, SingleThreadPolicy> {
+  int value = 3;
+};
+
+struct SharedObserved : WeakRefCounted<SharedObserved> {
+  std::atomic<int> hits{0};
+};
+
+void TestShared() {
+  static_assert(sizeof(IntrusiveSharedPtr<Node>) == sizeof(void*));
+  auto first = MakeIntrusive<Node>(5);
+  auto second = first;
+  assert(first.use_count() == 2 && second->value == 5);
+  IntrusiveSharedPtr<Node> adopted(first.get());
+  assert(first.use_count() == 3);
+  second = adopted;
+  second = std::move(adopted);
+  adopted = second;
+  first.reset();
+  second.reset();
+  assert(Node::live == 1);
+  adopted.reset();
+  assert(Node::live == 0);
+}
+
+void TestWeak() {
+  auto observed = MakeIntrusive<Observed>();
+  IntrusiveWeakPtr<Observed> weak(observed);
+  assert(!weak.expired());
+  {
+    auto locked = weak.lock();
+    assert(locked->value == 3 && observed.use_count() == 2);
+  }
+  IntrusiveWeakPtr<Observed> copy = weak;
+  observed.reset();
+  assert(weak.expired() && copy.expired());
+  bool threw = false;
+  try {
+    weak.lock();
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void TestWeakAcrossThreads() {
+  auto observed = MakeIntrusive<SharedObserved>();
+  IntrusiveWeakPtr<SharedObserved> weak(observed);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([weak] {
+      for (int i = 0; i < 20000; ++i) {
+        try {
+          ++weak.lock()->hits;
+        } catch (const std::runtime_error&) {
+        }
+      }
+    });
+  }
+  for (int i = 0; i < 1000; ++i) {
+    auto copy = observed;
+  }
+  observed.reset();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  assert(weak.expired());
+}
+
+}  // namespace
+
+int main() {
+  TestShared();
+  TestWeak();
+  TestWeakAcrossThreads();
+  std::puts("ok");
+}
@@ -0,0 +1,102 @@
+// Read-mostly shared values across threads, while a writer replaces the
+// value now and then: the lock-free slots next to a mutex around a
+// SharedPtr copy and to a plain SharedPtr copy.
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#include "../atomic_shared_ptr.hpp"
+#include "../hazard_ptr.hpp"
+#include "../snapshot.hpp"
+#include "bench.hpp"
+
+namespace {
+
+struct Table {
+  explicit Table(long value) {
+    for (long& entry : values) {
+      entry = value;
+    }
+  }
+
+  long values[8];
+};
+
+// Every thread reads while one more replaces the value every 100 us.
+template <typename Read, typename Write>
+double ReadNs(int threads, Read read, Write write) {
+  std::atomic<bool> stop{false};
+  std::thread writer([&] {
+    for (long i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+      write(i);
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  });
+  double ns = MeasureThreadsNs(threads, 2000000, [&](size_t n) {
+    long sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      sum += read(i);
+    }
+    KeepAlive(sum);
+  });
+  stop = true;
+  writer.join();
+  return ns;
+}
+
+}  // namespace
+
+int main() {
+  std::mutex mutex;
+  SharedPtr<Table> locked = MakeShared<Table>(1);
+  SharedPtr<Table> plain = MakeShared<Table>(1);
+  AtomicSharedPtr<Table> atomic_slot(MakeShared<Table>(1));
+  ProtectedSharedPtr<Table> protected_slot(MakeShared<Table>(1));
+  Snapshot<Table> snapshot(MakeShared<Table>(1));
+
+  for (int threads : ThreadCounts()) {
+    std::printf("%d threads, mutex + copy: %.2f ns\n", threads,
+                ReadNs(
+                    threads,
+                    [&](size_t i) {
+                      SharedPtr<Table> copy;
+                      {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        copy = locked;
+                      }
+                      return copy->values[i & 7];
+                    },
+                    [&](long i) {
+                      SharedPtr<Table> next = MakeShared<Table>(i);
+                      std::lock_guard<std::mutex> lock(mutex);
+                      locked = next;
+                    }));
+    std::printf("%d threads, unprotected copy: %.2f ns\n", threads,
+                ReadNs(
+                    threads,
+                    [&](size_t i) {
+                      SharedPtr<Table> copy = plain;
+                      return copy->values[i & 7];
+                    },
+                    [](long) {}));
+    std::printf(
+        "%d threads, AtomicSharedPtr::load: %.2f ns\n", threads,
+        ReadNs(
+            threads,
+            [&](size_t i) { return atomic_slot.load()->values[i & 7]; },
+            [&](long i) { atomic_slot.store(MakeShared<Table>(i)); }));
+    std::printf(
+        "%d threads, ProtectedSharedPtr::guard: %.2f ns\n", threads,
+        ReadNs(
+            threads,
+            [&](size_t i) { return protected_slot.guard()->values[i & 7]; },
+            [&](long i) { protected_slot.store(MakeShared<Table>(i)); }));
+    std::printf("%d threads, Snapshot::read: %.2f ns\n", threads,
+                ReadNs(
+                    threads,
+                    [&](size_t i) { return snapshot.read()->values[i & 7]; },
+                    [&](long i) { snapshot.emplace(i); }));
+  }
+}
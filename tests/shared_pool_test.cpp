@@ -0,0 +1,129 @@
+// SharedPool: recycling on the owning thread, the max_cached bound,
+// releases from other threads, orphaned caches and EnableSharedFromThis.
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../shared_pool.hpp"
+
+namespace {
+
+struct Buffer {
+  static inline std::atomic<int> built{0};
+  static inline std::atomic<int> live{0};
+
+  Buffer() : data(1 << 12) {
+    ++built;
+    ++live;
+  }
+
+  ~Buffer() { --live; }
+
+  std::vector<char> data;
+  int resets = 0;
+};
+
+void TestRecycling() {
+  SharedPool<Buffer> pool(4, [](Buffer& buffer) { ++buffer.resets; });
+  Buffer* first;
+  {
+    auto buffer = pool.acquire();
+    first = buffer.get();
+  }
+  {
+    auto buffer = pool.acquire();
+    assert(buffer.get() == first && buffer->resets == 1);
+    {
+      // The slot goes back to the pool once the weak reference is gone too.
+      WeakPtr<Buffer> weak(buffer);
+      buffer.reset();
+      assert(weak.expired());
+    }
+    auto other = pool.acquire();
+    auto again = pool.acquire();
+    assert(other.get() == first && again.get() != first);
+  }
+  SharedPool<Buffer>::Stats stats = pool.stats();
+  assert(stats.hits == 2 && stats.misses == 2 && Buffer::built == 2);
+
+  std::vector<SharedPtr<Buffer>> many;
+  for (int i = 0; i < 10; ++i) {
+    many.push_back(pool.acquire());
+  }
+  many.clear();
+  stats = pool.stats();
+  assert(stats.discarded == 6);
+}
+
+void TestRemoteRelease() {
+  SharedPool<Buffer> pool(8);
+  std::vector<SharedPtr<Buffer>> batch;
+  for (int i = 0; i < 4; ++i) {
+    batch.push_back(pool.acquire());
+  }
+  std::thread([batch = std::move(batch)]() mutable { batch.clear(); }).join();
+  int built = Buffer::built;
+  for (int i = 0; i < 4; ++i) {
+    batch.push_back(pool.acquire());
+  }
+  assert(Buffer::built == built);
+  batch.clear();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&pool] {
+      std::vector<SharedPtr<Buffer>> held;
+      for (int i = 0; i < 2000; ++i) {
+        held.push_back(pool.acquire());
+        if (held.size() > 6) {
+          held.erase(held.begin());
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  // Takes over a cache that one of the threads above left.
+  std::thread([&pool] { auto buffer = pool.acquire(); }).join();
+}
+
+struct Node : EnableSharedFromThis<Node> {
+  explicit Node(int node_value) : value(node_value) {}
+
+  int value;
+};
+
+void TestSharedFromThis() {
+  SharedPool<Node> pool(4);
+  {
+    auto node = pool.acquire(9);
+    assert(node->shared_from_this().get() == node.get());
+  }
+  auto again = pool.acquire(1);
+  assert(again->value == 9);
+  assert(again->shared_from_this().get() == again.get());
+}
+
+void TestPolicies() {
+  SharedPool<std::string, SingleThreadPolicy> strings(2);
+  assert(*strings.acquire("abc") == "abc");
+  SharedPool<Buffer, BiasedThreadPolicy> biased;
+  auto buffer = biased.acquire();
+  auto copy = buffer;
+}
+
+}  // namespace
+
+int main() {
+  TestRecycling();
+  TestRemoteRelease();
+  TestSharedFromThis();
+  TestPolicies();
+  assert(Buffer::live == 0);
+  std::puts("ok");
+}
@@ -0,0 +1,140 @@
+// SlabPool next to operator new: allocate/free churn on one thread and on
+// several at once, and a producer/consumer pair where every block is freed
+// by the thread that did not make it.
+
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "../smart_pointers.hpp"
+#include "bench.hpp"
+
+namespace {
+
+const size_t kAlignment = alignof(std::max_align_t);
+
+struct SlabSource {
+  static void* allocate(size_t size) {
+    return SlabPool::allocate(size, kAlignment);
+  }
+
+  static void deallocate(void* block, size_t size) {
+    SlabPool::deallocate(block, size, kAlignment);
+  }
+};
+
+struct NewSource {
+  static void* allocate(size_t size) { return ::operator new(size); }
+
+  static void deallocate(void* block, size_t) { ::operator delete(block); }
+};
+
+// Keeps a window of live blocks of mixed sizes and replaces one per step.
+template <typename Source>
+void Churn(size_t steps) {
+  const size_t window = 256;
+  std::vector<void*> blocks(window, nullptr);
+  for (size_t i = 0; i < steps; ++i) {
+    size_t slot = (i * 7919) % window;
+    size_t size = 16 + (slot % 8) * 16;
+    if (blocks[slot]) {
+      Source::deallocate(blocks[slot], size);
+    }
+    blocks[slot] = Source::allocate(size);
+  }
+  for (size_t slot = 0; slot < window; ++slot) {
+    if (blocks[slot]) {
+      Source::deallocate(blocks[slot], 16 + (slot % 8) * 16);
+    }
+  }
+}
+
+void CompareChurn() {
+  for (int threads : ThreadCounts()) {
+    double slab_ns = MeasureThreadsNs(threads, 2000000, Churn<SlabSource>);
+    double new_ns = MeasureThreadsNs(threads, 2000000, Churn<NewSource>);
+    std::printf("%d threads, churn: SlabPool %.2f ns, operator new %.2f ns\n",
+                threads, slab_ns, new_ns);
+  }
+}
+
+template <typename Source>
+double ProducerConsumerNs(size_t count) {
+  const size_t size = 48;
+  std::mutex mutex;
+  std::vector<void*> queue;
+  bool done = false;
+  auto start = std::chrono::steady_clock::now();
+  std::thread consumer([&] {
+    std::vector<void*> taken;
+    while (true) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        taken.swap(queue);
+        if (taken.empty() && done) {
+          return;
+        }
+      }
+      for (void* block : taken) {
+        Source::deallocate(block, size);
+      }
+      taken.clear();
+    }
+  });
+  std::vector<void*> made;
+  for (size_t i = 0; i < count; ++i) {
+    made.push_back(Source::allocate(size));
+    if (made.size() == 64) {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.insert(queue.end(), made.begin(), made.end());
+      made.clear();
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.insert(queue.end(), made.begin(), made.end());
+    done = true;
+  }
+  consumer.join();
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / count;
+}
+
+void CompareProducerConsumer() {
+  for (int round = 0; round < 3; ++round) {
+    std::printf("producer/consumer: SlabPool %.2f ns, operator new %.2f ns\n",
+                ProducerConsumerNs<SlabSource>(2000000),
+                ProducerConsumerNs<NewSource>(2000000));
+  }
+}
+
+// Control blocks of adopted pointers come from the slabs; the object itself
+// still comes from new.
+void CompareAdoption() {
+  double slab_ns = MeasureNs(2000000, [](size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      SharedPtr<long> ptr(new long(1));
+      KeepAlive(ptr);
+    }
+  });
+  double std_ns = MeasureNs(2000000, [](size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      std::shared_ptr<long> ptr(new long(1));
+      KeepAlive(ptr);
+    }
+  });
+  std::printf("SharedPtr(new) %.2f ns, std::shared_ptr(new) %.2f ns\n",
+              slab_ns, std_ns);
+}
+
+}  // namespace
+
+int main() {
+  CompareChurn();
+  CompareProducerConsumer();
+  CompareAdoption();
+}
@@ -0,0 +1,105 @@
+// SlabPool and SlabAllocator: blocks freed by the thread that made them,
+// by other threads through the remote lists, by threads whose caches were
+// handed over, and blocks too large or too aligned for the slabs.
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../smart_pointers.hpp"
+
+namespace {
+
+void TestLocal() {
+  std::vector<void*> blocks;
+  for (int i = 0; i < 10000; ++i) {
+    size_t size = 1 + i % SlabPool::kMaxBlockSize;
+    void* block = SlabPool::allocate(size, alignof(std::max_align_t));
+    assert(reinterpret_cast<uintptr_t>(block) % SlabPool::kGranularity == 0);
+    std::memset(block, 0xab, size);
+    blocks.push_back(block);
+  }
+  for (int i = 0; i < 10000; ++i) {
+    SlabPool::deallocate(blocks[i], 1 + i % SlabPool::kMaxBlockSize,
+                         alignof(std::max_align_t));
+  }
+  void* big = SlabPool::allocate(4096, 16);
+  void* aligned = SlabPool::allocate(64, 64);
+  assert(reinterpret_cast<uintptr_t>(aligned) % 64 == 0);
+  SlabPool::deallocate(big, 4096, 16);
+  SlabPool::deallocate(aligned, 64, 64);
+}
+
+// Every control block is made by the producer and freed by the consumer.
+void TestProducerConsumer() {
+  for (int round = 0; round < 3; ++round) {
+    std::mutex mutex;
+    std::deque<SharedPtr<int>> queue;
+    bool done = false;
+    std::thread consumer([&] {
+      while (true) {
+        std::deque<SharedPtr<int>> taken;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          taken.swap(queue);
+          if (taken.empty() && done) {
+            return;
+          }
+        }
+      }
+    });
+    std::thread producer([&] {
+      for (int i = 0; i < 100000; ++i) {
+        SharedPtr<int> ptr(new int(i));
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(ptr));
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+    });
+    producer.join();
+    consumer.join();
+  }
+}
+
+// Threads come and go, each taking over a cache left by an earlier one and
+// freeing blocks that other threads made.
+void TestThreadTurnover() {
+  std::vector<SharedPtr<int>> survivors;
+  std::mutex mutex;
+  for (int round = 0; round < 20; ++round) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&] {
+        std::vector<SharedPtr<int>> made;
+        for (int i = 0; i < 1000; ++i) {
+          made.emplace_back(new int(i));
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < survivors.size(); i += 2) {
+          survivors[i].reset();
+        }
+        survivors.insert(survivors.end(), made.begin(), made.begin() + 10);
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+  survivors.clear();
+}
+
+}  // namespace
+
+int main() {
+  TestLocal();
+  TestProducerConsumer();
+  TestThreadTurnover();
+  std::puts("ok");
+}
@@ -0,0 +1,268 @@
+// SharedPtr and WeakPtr next to std::shared_ptr and std::weak_ptr. Every
+// Compare function prints one measurement per line.
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../smart_pointers.hpp"
+#include "bench.hpp"
+
+namespace {
+
+struct Object {
+  long values[2] = {1, 2};
+};
+
+void PrintSizes() {
+  using Shared = SharedPtr<Object>;
+  std::printf("sizes: SharedPtr %zu, std::shared_ptr %zu\n", sizeof(Shared),
+              sizeof(std::shared_ptr<Object>));
+  std::printf("sizes: DirectPtrCounter %zu, NonDirectPtrCounter %zu\n",
+              sizeof(Shared::DirectPtrCounter<Object>),
+              sizeof(Shared::NonDirectPtrCounter<>));
+}
+
+template <typename Policy>
+double CopyNs() {
+  auto shared = MakeShared<Object, Policy>();
+  return MeasureNs(10000000, [&](size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      SharedPtr<Object, Policy> copy = shared;
+      KeepAlive(copy);
+    }
+  });
+}
+
+void CompareCopies() {
+  auto std_shared = std::make_shared<Object>();
+  std::printf("copy + release, std::shared_ptr: %.2f ns\n",
+              MeasureNs(10000000, [&](size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                  std::shared_ptr<Object> copy = std_shared;
+                  KeepAlive(copy);
+                }
+              }));
+  std::printf("copy + release, SingleThreadPolicy: %.2f ns\n",
+              CopyNs<SingleThreadPolicy>());
+  std::printf("copy + release, MultiThreadPolicy: %.2f ns\n",
+              CopyNs<MultiThreadPolicy>());
+  std::printf("copy + release, BiasedThreadPolicy: %.2f ns\n",
+              CopyNs<BiasedThreadPolicy>());
+  std::printf("copy + release, DeferredPolicy: %.2f ns\n",
+              CopyNs<DeferredPolicy>());
+}
+
+// Every thread copies the same object, so all of them hit one counter.
+template <typename Policy>
+double ContendedCopyNs(int threads) {
+  auto shared = MakeShared<Object, Policy>();
+  return MeasureThreadsNs(threads, 2000000, [&](size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      SharedPtr<Object, Policy> copy = shared;
+      KeepAlive(copy);
+    }
+  });
+}
+
+void CompareContendedCopies() {
+  for (int threads : ThreadCounts()) {
+    auto std_shared = std::make_shared<Object>();
+    std::printf("%d threads, one object, std::shared_ptr: %.2f ns\n", threads,
+                MeasureThreadsNs(threads, 2000000, [&](size_t n) {
+                  for (size_t i = 0; i < n; ++i) {
+                    std::shared_ptr<Object> copy = std_shared;
+                    KeepAlive(copy);
+                  }
+                }));
+    std::printf("%d threads, one object, SharedPtr: %.2f ns\n", threads,
+                ContendedCopyNs<MultiThreadPolicy>(threads));
+    std::printf("%d threads, one object, BiasedThreadPolicy: %.2f ns\n",
+                threads, ContendedCopyNs<BiasedThreadPolicy>(threads));
+  }
+}
+
+void CompareWeakPromotion() {
+  for (int threads : ThreadCounts()) {
+    auto shared = MakeShared<Object>();
+    WeakPtr<Object> weak(shared);
+    std::printf("%d threads, weak lock, WeakPtr: %.2f ns\n", threads,
+                MeasureThreadsNs(threads, 1000000, [&](size_t n) {
+                  for (size_t i = 0; i < n; ++i) {
+                    SharedPtr<Object> locked = weak.lock();
+                    KeepAlive(locked);
+                  }
+                }));
+    auto std_shared = std::make_shared<Object>();
+    std::weak_ptr<Object> std_weak(std_shared);
+    std::printf("%d threads, weak lock, std::weak_ptr: %.2f ns\n", threads,
+                MeasureThreadsNs(threads, 1000000, [&](size_t n) {
+                  for (size_t i = 0; i < n; ++i) {
+                    std::shared_ptr<Object> locked = std_weak.lock();
+                    KeepAlive(locked);
+                  }
+                }));
+  }
+}
+
+void CompareAllocation() {
+  std::printf("create + release, MakeShared: %.2f ns\n",
+              MeasureNs(2000000, [](size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                  auto ptr = MakeShared<Object>();
+                  KeepAlive(ptr);
+                }
+              }));
+  std::printf("create + release, SharedPtr(new): %.2f ns\n",
+              MeasureNs(2000000, [](size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                  SharedPtr<Object> ptr(new Object);
+                  KeepAlive(ptr);
+                }
+              }));
+  std::printf("create + release, std::make_shared: %.2f ns\n",
+              MeasureNs(2000000, [](size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                  auto ptr = std::make_shared<Object>();
+                  KeepAlive(ptr);
+                }
+              }));
+}
+
+void CompareBatch() {
+  const size_t count = 50000;
+  std::printf("50000 objects, one by one: %.2f ns\n",
+              MeasureNs(count, [](size_t n) {
+                std::vector<SharedPtr<Object>> objects;
+                objects.reserve(n);
+                for (size_t i = 0; i < n; ++i) {
+                  objects.push_back(MakeShared<Object>());
+                }
+                KeepAlive(objects);
+              }));
+  std::printf("50000 objects, MakeSharedBatch: %.2f ns\n",
+              MeasureNs(count, [](size_t n) {
+                auto objects = MakeSharedBatch<Object>(
+                    n, [](size_t) { return Object(); });
+                KeepAlive(objects);
+              }));
+}
+
+template <typename Policy>
+struct TreeNode {
+  std::vector<SharedPtr<TreeNode, Policy>> children;
+};
+
+template <typename Policy>
+double ResetTreeUs() {
+  auto root = MakeShared<TreeNode<Policy>, Policy>();
+  for (int i = 0; i < 200000; ++i) {
+    root->children.push_back(MakeShared<TreeNode<Policy>, Policy>());
+  }
+  auto start = std::chrono::steady_clock::now();
+  root.reset();
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+void CompareDeferredRelease() {
+  std::printf("release of 200000 children, inline: %.0f us\n",
+              ResetTreeUs<MultiThreadPolicy>());
+  std::printf("release of 200000 children, deferred: %.2f us\n",
+              ResetTreeUs<DeferredPolicy>());
+  auto start = std::chrono::steady_clock::now();
+  size_t drained = DrainDeferred();
+  std::chrono::duration<double, std::micro> drain_us =
+      std::chrono::steady_clock::now() - start;
+  std::printf("drain, %zu blocks queued, the rest inline: %.0f us\n",
+              drained, drain_us.count());
+}
+
+void CompareTryLock() {
+  auto shared = MakeShared<int>(1);
+  WeakPtr<int> live(shared);
+  WeakPtr<int> dead(MakeShared<int>(2));
+  std::printf("try_lock, live: %.2f ns\n",
+              MeasureNs(1000000, [&](size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                  SharedPtr<int> locked = live.try_lock();
+                  KeepAlive(locked);
+                }
+              }));
+  std::printf("try_lock, expired: %.2f ns\n",
+              MeasureNs(1000000, [&](size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                  SharedPtr<int> locked = dead.try_lock();
+                  KeepAlive(locked);
+                }
+              }));
+  std::printf("lock + catch, expired: %.2f ns\n",
+              MeasureNs(100000, [&](size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                  try {
+                    SharedPtr<int> locked = dead.lock();
+                    KeepAlive(locked);
+                  } catch (const std::runtime_error&) {
+                  }
+                }
+              }));
+}
+
+void CompareLocking() {
+  const size_t count = 1000000;
+  std::vector<SharedPtr<int>> owners;
+  for (size_t i = 0; i < count; ++i) {
+    owners.push_back(MakeShared<int>(i));
+  }
+  std::vector<size_t> order(count);
+  for (size_t i = 0; i < count; ++i) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937(1));
+  std::vector<WeakPtr<int>> weak;
+  for (size_t i : order) {
+    weak.emplace_back(owners[i]);
+  }
+  for (size_t i = 0; i < count; i += 10) {
+    owners[i].reset();
+  }
+  std::vector<SharedPtr<int>> out;
+  out.reserve(count);
+  std::printf("1M weak, 10%% dead, try_lock loop: %.2f ns\n",
+              MeasureNs(count, [&](size_t) {
+                out.clear();
+                for (WeakPtr<int>& entry : weak) {
+                  SharedPtr<int> locked = entry.try_lock();
+                  if (locked.get()) {
+                    out.push_back(std::move(locked));
+                  }
+                }
+              }));
+  std::printf("1M weak, 10%% dead, LockAll: %.2f ns\n",
+              MeasureNs(count, [&](size_t) {
+                out.clear();
+                LockAll(weak, out);
+              }));
+}
+
+}  // namespace
+
+int main() {
+  // libstdc++ counts without atomics until the process starts a thread;
+  // start one so std::shared_ptr pays what it would in a real program.
+  std::thread([] {}).join();
+  PrintSizes();
+  CompareCopies();
+  CompareContendedCopies();
+  CompareWeakPromotion();
+  CompareAllocation();
+  CompareBatch();
+  CompareDeferredRelease();
+  CompareTryLock();
+  CompareLocking();
+}
@@ -0,0 +1,619 @@
+// SharedPtr, WeakPtr and the helpers around them. Every Test function
+// covers one feature; main runs them all.
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../smart_pointers.hpp"
+
+namespace {
+
+struct Tracked {
+  static inline std::atomic<int> live{0};
+
+  Tracked() { ++live; }
+
+  Tracked(const Tracked&) { ++live; }
+
+  virtual ~Tracked() { --live; }
+
+  int value = 7;
+};
+
+struct Left {
+  virtual ~Left() = default;
+  int left = 1;
+};
+
+struct Right {
+  virtual ~Right() = default;
+  int right = 2;
+};
+
+struct Joined : Left, Right, Tracked {
+  int joined = 3;
+};
+
+// Counts what goes through it, to check where memory comes from.
+struct Arena {
+  int allocations = 0;
+  int deallocations = 0;
+};
+
+template <typename U>
+struct ArenaAllocator {
+  using value_type = U;
+
+  explicit ArenaAllocator(Arena* owner) : arena(owner) {}
+
+  template <typename V>
+  ArenaAllocator(const ArenaAllocator<V>& other) : arena(other.arena) {}
+
+  U* allocate(size_t n) {
+    ++arena->allocations;
+    return static_cast<U*>(::operator new(n * sizeof(U)));
+  }
+
+  void deallocate(U* ptr, size_t) {
+    ++arena->deallocations;
+    ::operator delete(ptr);
+  }
+
+  template <typename V>
+  bool operator==(const ArenaAllocator<V>& other) const {
+    return arena == other.arena;
+  }
+
+  template <typename V>
+  bool operator!=(const ArenaAllocator<V>& other) const {
+    return arena != other.arena;
+  }
+
+  Arena* arena;
+};
+
+template <typename Policy>
+void TestBasics() {
+  {
+    SharedPtr<Tracked, Policy> first(new Tracked);
+    SharedPtr<Tracked, Policy> second = first;
+    assert(first.use_count() == 2);
+    WeakPtr<Tracked, Policy> weak(first);
+    {
+      SharedPtr<Tracked, Policy> locked = weak.lock();
+      assert(locked.use_count() == 3 && locked->value == 7);
+    }
+    second.reset();
+    first.reset();
+    assert(Tracked::live == 0 && weak.expired());
+    bool threw = false;
+    try {
+      weak.lock();
+    } catch (const std::runtime_error&) {
+      threw = true;
+    }
+    assert(threw);
+  }
+  {
+    auto text = MakeShared<std::string, Policy>("hello");
+    WeakPtr<std::string, Policy> weak(text);
+    WeakPtr<std::string, Policy> copy;
+    copy = weak;
+    assert(*copy.lock() == "hello");
+    text.reset();
+    assert(copy.expired());
+  }
+  {
+    // A SharedPtr made from a counter takes a reference of its own.
+    auto shared = MakeShared<Tracked, Policy>();
+    SharedPtr<Tracked, Policy> from_counter = shared.get_ptr_counter();
+    assert(shared.use_count() == 2 && from_counter.get() == shared.get());
+    shared.reset();
+    assert(Tracked::live == 1);
+    from_counter.reset();
+    assert(Tracked::live == 0);
+  }
+}
+
+void TestSharingAcrossThreads() {
+  auto shared = MakeShared<std::vector<int>>(100, 1);
+  WeakPtr<std::vector<int>> weak(shared);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([shared, weak] {
+      for (int i = 0; i < 20000; ++i) {
+        SharedPtr<std::vector<int>> copy = shared;
+        SharedPtr<std::vector<int>> locked = weak.lock();
+        assert((*copy)[3] == 1 && locked.get() == copy.get());
+      }
+    });
+  }
+  shared.reset();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  assert(weak.expired());
+}
+
+void TestThin() {
+  static_assert(sizeof(ThinSharedPtr<std::string>) == sizeof(void*));
+  auto text = MakeShared<std::string>("abc");
+  ThinSharedPtr<std::string> thin(text);
+  assert(text.use_count() == 2 && *thin == "abc" && thin->size() == 3);
+  ThinSharedPtr<std::string> moved(std::move(text));
+  assert(!text.get() && moved.use_count() == 2);
+  SharedPtr<std::string> back = std::move(moved).to_shared();
+  assert(back.use_count() == 2 && !moved.get());
+  SharedPtr<std::string> direct(new std::string("x"));
+  bool threw = false;
+  try {
+    ThinSharedPtr<std::string> rejected(direct);
+  } catch (const std::invalid_argument&) {
+    threw = true;
+  }
+  assert(threw && direct.use_count() == 1);
+}
+
+int freed = 0;
+
+void TestDeleters() {
+  {
+    int* raw = static_cast<int*>(std::malloc(sizeof(int)));
+    SharedPtr<int> owner(raw, [](int* ptr) {
+      ++freed;
+      std::free(ptr);
+    });
+    SharedPtr<int> copy = owner;
+  }
+  assert(freed == 1);
+  // Empty deleters take no room in the counter.
+  auto stateless = [](int*) {};
+  static_assert(sizeof(SharedPtr<int>::DirectPtrCounter<
+                       int, std::default_delete<int>>) == 24);
+  static_assert(
+      sizeof(SharedPtr<int>::DirectPtrCounter<int, decltype(stateless)>) ==
+      24);
+  static_assert(sizeof(SharedPtr<long>::NonDirectPtrCounter<>) == 24);
+  {
+    SharedPtr<std::FILE> file(std::tmpfile(), &std::fclose);
+    assert(file.get());
+  }
+  {
+    SharedPtr<Tracked> base(new Joined);
+    SharedPtr<Tracked> custom(new Joined, [](Joined* ptr) { delete ptr; });
+  }
+  assert(Tracked::live == 0);
+}
+
+struct Throwing {
+  Throwing() { throw 1; }
+};
+
+void TestAllocators() {
+  Arena arena;
+  {
+    auto text = AllocateShared<std::string>(
+        ArenaAllocator<char>(&arena), "long enough to live on the heap");
+    assert(*text == "long enough to live on the heap");
+    assert(arena.allocations == 1);
+    WeakPtr<std::string> weak(text);
+    text.reset();
+    assert(arena.deallocations == 0);
+  }
+  assert(arena.deallocations == 1);
+  {
+    SharedPtr<int> direct(new int(3), std::default_delete<int>(),
+                          ArenaAllocator<int>(&arena));
+    assert(arena.allocations == 2);
+  }
+  assert(arena.deallocations == 2);
+  try {
+    AllocateShared<Throwing>(ArenaAllocator<int>(&arena));
+    assert(false);
+  } catch (int) {
+  }
+  assert(arena.allocations == 3 && arena.deallocations == 3);
+}
+
+struct Page {
+  char bytes[4096];
+};
+
+void TestForOverwrite() {
+  auto page = MakeSharedForOverwrite<Page>();
+  std::memset(page->bytes, 'x', sizeof(page->bytes));
+  assert(page->bytes[4095] == 'x');
+  auto buffer = MakeSharedForOverwrite<char[65536]>();
+  std::memset(buffer.get(), 'x', 65536);
+  assert(buffer[65535] == 'x');
+  auto text = MakeSharedForOverwrite<std::string>();
+  assert(text->empty());
+}
+
+struct Element {
+  static inline int live = 0;
+  static inline int throw_at = -1;
+
+  Element() {
+    if (live == throw_at) {
+      throw 1;
+    }
+    ++live;
+  }
+
+  Element(const Element&) : Element() {}
+
+  ~Element() { --live; }
+};
+
+struct alignas(64) Wide {
+  char bytes[64];
+};
+
+void TestArrays() {
+  auto zeros = MakeShared<int[]>(10);
+  for (int i = 0; i < 10; ++i) {
+    assert(zeros[i] == 0);
+  }
+  auto filled = MakeShared<std::string[]>(5, std::string("hi"));
+  assert(filled[4] == "hi");
+  auto uninitialized = MakeSharedForOverwrite<double[]>(1000);
+  uninitialized[999] = 1.5;
+  assert(uninitialized[999] == 1.5);
+  auto aligned = MakeShared<Wide[]>(3);
+  assert(reinterpret_cast<uintptr_t>(aligned.get()) % 64 == 0);
+  {
+    auto elements = MakeShared<Element[]>(7);
+    assert(Element::live == 7);
+    WeakPtr<Element[]> weak(elements);
+  }
+  assert(Element::live == 0);
+  Element::throw_at = 3;
+  try {
+    MakeShared<Element[]>(8);
+    assert(false);
+  } catch (int) {
+  }
+  assert(Element::live == 0);
+  Element::throw_at = -1;
+  {
+    SharedPtr<Element[]> owned(new Element[4]);
+    assert(Element::live == 4);
+  }
+  assert(Element::live == 0);
+  SharedPtr<int[3]> fixed(new int[3]{1, 2, 3});
+  assert(fixed[2] == 3);
+  assert(MakeShared<int[]>(0).use_count() == 1);
+  try {
+    MakeShared<int[]>(SIZE_MAX / 2);
+    assert(false);
+  } catch (const std::bad_array_new_length&) {
+  }
+  assert((MakeShared<int[], SingleThreadPolicy>(4, 7)[3] == 7));
+}
+
+struct alignas(128) Wider {
+  int value = 3;
+};
+
+struct Hot {
+  long value = 1;
+};
+
+void TestLayouts() {
+  auto wider = MakeShared<Wider>();
+  assert(reinterpret_cast<uintptr_t>(wider.get()) % 128 == 0);
+  assert(reinterpret_cast<uintptr_t>(MakeShared<Wider[]>(3).get()) % 128 == 0);
+  auto hot = MakeShared<Hot, MultiThreadPolicy, CacheLineLayout>();
+  uintptr_t counter = reinterpret_cast<uintptr_t>(hot.get_ptr_counter());
+  uintptr_t object = reinterpret_cast<uintptr_t>(hot.get());
+  assert(counter % 64 == 0 && object % 64 == 0 && object - counter >= 64);
+  auto hot_array = MakeShared<Hot[], MultiThreadPolicy, CacheLineLayout>(5);
+  assert(reinterpret_cast<uintptr_t>(hot_array.get()) % 64 == 0);
+  assert(hot_array[4].value == 1);
+}
+
+struct Message {
+  std::string name = "n";
+  int fields[4] = {1, 2, 3, 4};
+};
+
+void TestAliasing() {
+  SharedPtr<std::string> name;
+  SharedPtr<int> field;
+  {
+    auto message = MakeShared<Message>();
+    name = SharedPtr<std::string>(message, &message->name);
+    assert(message.use_count() == 2);
+    int* third = &message->fields[2];
+    field = SharedPtr<int>(std::move(message), third);
+    assert(!message.get() && name.use_count() == 2);
+  }
+  assert(*name == "n" && *field == 3);
+  WeakPtr<int> weak(field);
+  name.reset();
+  assert(*weak.lock() == 3);
+  field.reset();
+  assert(weak.expired());
+  SharedPtr<int> empty(SharedPtr<Message>(), nullptr);
+  assert(empty.use_count() == 0);
+}
+
+// SharedPtrs and WeakPtrs of different types share one control block.
+void TestConversions() {
+  {
+    auto joined = MakeShared<Joined>();
+    SharedPtr<Right> right;
+    right = joined;
+    assert(right.get() == static_cast<Right*>(joined.get()));
+    assert(right->right == 2);
+    WeakPtr<Right> weak_right(joined);
+    WeakPtr<Joined> weak_joined(joined);
+    WeakPtr<Left> weak_left;
+    weak_left = weak_joined;
+    assert(weak_right.lock().get() == right.get());
+    assert(weak_left.lock()->left == 1);
+    joined.reset();
+    assert(Tracked::live == 1 && right.use_count() == 1);
+    right.reset();
+    assert(Tracked::live == 0 && weak_right.expired() && weak_left.expired());
+  }
+  {
+    SharedPtr<Left> left(new Joined);
+    SharedPtr<int> alias(left, &static_cast<Joined*>(left.get())->joined);
+    left.reset();
+    assert(*alias == 3 && Tracked::live == 1);
+  }
+  assert(Tracked::live == 0);
+}
+
+struct Record : Tracked {
+  static inline int throw_at = -1;
+
+  explicit Record(long record_id) : id(record_id) {
+    if (record_id == throw_at) {
+      throw 1;
+    }
+  }
+
+  long id;
+};
+
+void TestBatch() {
+  Arena arena;
+  {
+    auto batch = AllocateSharedBatch<Record>(
+        ArenaAllocator<Record>(&arena), 1000,
+        [](size_t i) { return Record(i); });
+    assert(arena.allocations == 1 && Tracked::live == 1000);
+    SharedPtr<Record> kept = batch[500];
+    WeakPtr<Record> weak(batch[10]);
+    batch.clear();
+    assert(Tracked::live == 1 && kept->id == 500 && weak.expired());
+    assert(arena.deallocations == 0);
+  }
+  assert(Tracked::live == 0 && arena.deallocations == 1);
+  for (int throw_at : {0, 7}) {
+    Record::throw_at = throw_at;
+    try {
+      MakeSharedBatch<Record>(10, [](size_t i) { return Record(i); });
+      assert(false);
+    } catch (int) {
+    }
+    assert(Tracked::live == 0);
+  }
+  Record::throw_at = -1;
+  assert(MakeSharedBatch<int>(0, [](size_t) { return 1; }).empty());
+  // Objects of one batch die on different threads.
+  auto batch =
+      MakeSharedBatch<Record>(4000, [](size_t i) { return Record(i); });
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    std::vector<SharedPtr<Record>> part(batch.begin() + t * 1000,
+                                        batch.begin() + (t + 1) * 1000);
+    threads.emplace_back([part = std::move(part)]() mutable { part.clear(); });
+  }
+  batch.clear();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  assert(Tracked::live == 0);
+}
+
+// The last of several racing owners destroys the object exactly once, and
+// try_lock never revives it.
+void TestWeakPromotionRace() {
+  for (int round = 0; round < 200; ++round) {
+    auto shared = MakeShared<int>(42);
+    WeakPtr<int> weak(shared);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; ++t) {
+      threads.emplace_back([&weak] {
+        for (int i = 0; i < 200; ++i) {
+          SharedPtr<int> locked = weak.try_lock();
+          assert(!locked.get() || *locked == 42);
+        }
+      });
+    }
+    shared.reset();
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    assert(weak.expired() && !weak.try_lock().get());
+  }
+}
+
+struct Shape {
+  virtual ~Shape() = default;
+  int sides = 4;
+};
+
+struct Square : virtual Shape {};
+
+// Converting to a virtual base reads the object, which must not happen once
+// it is gone.
+void TestVirtualBaseConversion() {
+  SharedPtr<Square> square(new Square);
+  WeakPtr<Square> weak_square(square);
+  WeakPtr<Shape> live(weak_square);
+  assert(live.lock().get() == static_cast<Shape*>(square.get()));
+  assert(live.lock()->sides == 4);
+  square.reset();
+  WeakPtr<Shape> copied(weak_square);
+  WeakPtr<Shape> assigned;
+  assigned = weak_square;
+  WeakPtr<Square> moved_from(weak_square);
+  WeakPtr<Shape> moved(std::move(moved_from));
+  WeakPtr<Shape> move_assigned;
+  move_assigned = WeakPtr<Square>(weak_square);
+  for (const WeakPtr<Shape>* weak : {&copied, &assigned, &moved,
+                                     &move_assigned}) {
+    assert(weak->get_ptr_counter() == weak_square.get_ptr_counter());
+    assert(!weak->try_lock().get());
+  }
+  assert(live.expired() && copied.expired());
+}
+
+void TestLockAll() {
+  std::vector<SharedPtr<int>> owners;
+  std::vector<WeakPtr<int>> weak;
+  for (int i = 0; i < 100; ++i) {
+    owners.push_back(MakeShared<int>(i));
+    weak.emplace_back(owners.back());
+  }
+  weak.emplace_back();
+  for (int i = 0; i < 100; i += 3) {
+    owners[i].reset();
+  }
+  std::vector<SharedPtr<int>> out;
+  assert(LockAll(weak, out) == 66 && out.size() == 66 && weak.size() == 101);
+  for (size_t i = 1; i < out.size(); ++i) {
+    assert(*out[i - 1] < *out[i] && *out[i] % 3 != 0);
+  }
+  out.clear();
+  assert(LockAll(weak, out, true) == 66 && weak.size() == 66);
+  for (size_t i = 0; i < weak.size(); ++i) {
+    assert(*weak[i].lock() == *out[i]);
+  }
+  owners.clear();
+  out.clear();
+  assert(LockAll(weak.data(), weak.size(), out, true) == 0 && out.empty());
+  for (const WeakPtr<int>& entry : weak) {
+    assert(!entry.get_ptr_counter());
+  }
+}
+
+struct Node : EnableSharedFromThis<Node>, Tracked {
+  explicit Node(int node_value = 0) : value(node_value) {}
+
+  std::function<int()> callback() {
+    SharedPtr<Node> self = shared_from_this();
+    return [self] { return self->value; };
+  }
+
+  int value;
+};
+
+struct Base : EnableSharedFromThis<Base> {
+  virtual ~Base() = default;
+};
+
+struct Derived : Left, Base {};
+
+void TestSharedFromThis() {
+  {
+    auto node = MakeShared<Node>(5);
+    SharedPtr<Node> self = node->shared_from_this();
+    assert(self.get() == node.get() && node.use_count() == 2);
+    std::function<int()> callback = node->callback();
+    node.reset();
+    self.reset();
+    assert(Tracked::live == 1 && callback() == 5);
+  }
+  assert(Tracked::live == 0);
+  {
+    SharedPtr<Node> node(new Node(7));
+    assert(node->shared_from_this()->value == 7);
+    assert(node->weak_from_this().lock().get() == node.get());
+    SharedPtr<Node> copy(new Node(*node));
+    assert(copy->shared_from_this().get() == copy.get());
+  }
+  {
+    Node unowned(1);
+    bool threw = false;
+    try {
+      unowned.shared_from_this();
+    } catch (const std::runtime_error&) {
+      threw = true;
+    }
+    assert(threw && unowned.weak_from_this().expired());
+  }
+  {
+    SharedPtr<Left> left(new Derived);
+    Derived* derived = static_cast<Derived*>(left.get());
+    assert(derived->shared_from_this().get() == static_cast<Base*>(derived));
+  }
+  {
+    auto batch = MakeSharedBatch<Node>(10, [](size_t i) { return Node(i); });
+    for (const SharedPtr<Node>& node : batch) {
+      assert(node->shared_from_this().get() == node.get());
+    }
+  }
+  assert(Tracked::live == 0);
+}
+
+void TestOwnerHashing() {
+  auto message = MakeShared<Message>();
+  auto other = MakeShared<Message>();
+  SharedPtr<std::string> name(message, &message->name);
+  WeakPtr<Message> weak(message);
+  assert(!message.owner_before(name) && !name.owner_before(message));
+  assert(message.owner_before(other) != other.owner_before(message));
+  assert(weak.owner_before(other) == message.owner_before(other));
+  OwnerHash hash;
+  OwnerEqual equal;
+  assert(hash(message) == hash(weak) && hash(name) == hash(message));
+  assert(equal(message, name) && !equal(message, other));
+  std::unordered_map<WeakPtr<Message>, int, OwnerHash, OwnerEqual> map;
+  map[weak] = 1;
+  map[WeakPtr<Message>(other)] = 2;
+  size_t before = hash(weak);
+  message.reset();
+  name.reset();
+  assert(weak.expired() && hash(weak) == before && map.at(weak) == 1);
+  assert(map.at(WeakPtr<Message>(other)) == 2);
+}
+
+}  // namespace
+
+int main() {
+  TestBasics<SingleThreadPolicy>();
+  TestBasics<MultiThreadPolicy>();
+  TestBasics<BiasedThreadPolicy>();
+  TestSharingAcrossThreads();
+  TestThin();
+  TestDeleters();
+  TestAllocators();
+  TestForOverwrite();
+  TestArrays();
+  TestLayouts();
+  TestAliasing();
+  TestConversions();
+  TestBatch();
+  TestWeakPromotionRace();
+  TestVirtualBaseConversion();
+  TestLockAll();
+  TestSharedFromThis();
+  TestOwnerHashing();
+  std::puts("ok");
+}
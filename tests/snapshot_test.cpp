@@ -0,0 +1,89 @@
+// Snapshot and EpochDomain: versions outlive the sections that can see
+// them, load() keeps one past a section, and readers race a writer without
+// ever seeing a torn or destroyed version.
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../snapshot.hpp"
+
+namespace {
+
+struct Config {
+  static inline std::atomic<int> live{0};
+
+  explicit Config(int config_value)
+      : value(config_value),
+        negated(-config_value),
+        text(std::to_string(config_value)) {
+    ++live;
+  }
+
+  ~Config() {
+    value = negated = 0xdead;
+    --live;
+  }
+
+  int value;
+  int negated;
+  std::string text;
+};
+
+void TestSections() {
+  Snapshot<Config> snapshot(MakeShared<Config>(1));
+  {
+    auto guard = snapshot.read();
+    auto nested = snapshot.read();
+    assert(guard->value == 1 && nested->negated == -1);
+    snapshot.emplace(2);
+    assert(Config::live == 2 && guard->value == 1);
+  }
+  snapshot.synchronize();
+  assert(Config::live == 1);
+  SharedPtr<Config> kept = snapshot.load();
+  snapshot.emplace(3);
+  snapshot.synchronize();
+  assert(Config::live == 2 && kept->value == 2);
+  kept.reset();
+  assert(Config::live == 1);
+
+  Snapshot<Config> empty;
+  assert(!empty.read().get() && !empty.load().get());
+}
+
+void TestReadersAndWriter() {
+  Snapshot<Config> snapshot(MakeShared<Config>(0));
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; ++t) {
+    readers.emplace_back([&] {
+      while (!stop.load(std::memory_order_relaxed)) {
+        auto guard = snapshot.read();
+        assert(guard->value == -guard->negated);
+        assert(std::to_string(guard->value) == guard->text);
+      }
+    });
+  }
+  for (int i = 0; i < 20000; ++i) {
+    snapshot.emplace(i + 10);
+  }
+  stop = true;
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  snapshot.synchronize();
+  assert(Config::live == 1);
+}
+
+}  // namespace
+
+int main() {
+  TestSections();
+  TestReadersAndWriter();
+  assert(Config::live == 0);
+  std::puts("ok");
+}
@@ -0,0 +1,140 @@
+// WeakValueCache: hits and expiry, values built once under concurrent
+// lookups, factories that throw, inserts while a factory runs, pruning and
+// the sweeper.
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../weak_value_cache.hpp"
+
+namespace {
+
+struct Object {
+  static inline std::atomic<int> built{0};
+
+  explicit Object(int object_key) : key(object_key) {
+    ++built;
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+
+  int key;
+};
+
+void TestLookups() {
+  WeakValueCache<int, Object> cache(4);
+  {
+    auto first = cache.get_or_emplace(1, 1);
+    auto second = cache.get_or_emplace(1, 99);
+    assert(first.get() == second.get() && second->key == 1);
+    assert(Object::built == 1);
+    assert(cache.get(1).get() == first.get() && !cache.get(2).get());
+  }
+  assert(!cache.get(1).get());
+  WeakValueCache<int, Object>::Stats stats = cache.stats();
+  assert(stats.hits == 2 && stats.misses == 3 && stats.expired == 1);
+  assert(cache.get_or_emplace(1, 2)->key == 2);
+
+  auto value = MakeShared<Object>(7);
+  cache.put(7, value);
+  assert(cache.get(7).get() == value.get());
+  assert(cache.erase(7) && !cache.get(7).get() && !cache.erase(7));
+}
+
+void TestSingleConstruction() {
+  WeakValueCache<int, Object> cache;
+  for (int round = 0; round < 20; ++round) {
+    Object::built = 0;
+    std::vector<SharedPtr<Object>> got(4);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&, t] {
+        got[t] = cache.get_or_emplace(1000 + round, round);
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    assert(Object::built == 1);
+    for (const SharedPtr<Object>& value : got) {
+      assert(value.get() == got[0].get());
+    }
+  }
+}
+
+void TestThrowingFactory() {
+  WeakValueCache<int, Object> cache;
+  bool threw = false;
+  try {
+    cache.get_or_create(5, []() -> SharedPtr<Object> {
+      throw std::runtime_error("factory");
+    });
+  } catch (const std::runtime_error&) {
+    threw = true;
+  }
+  assert(threw && !cache.get(5).get() && cache.size() == 0);
+}
+
+// Other keys are inserted while a factory runs unlocked, enough of them to
+// rehash the shard under the entry being built.
+void TestInsertsDuringFactory() {
+  WeakValueCache<int, int> cache(1);
+  std::atomic<bool> in_factory{false};
+  std::atomic<bool> release{false};
+  SharedPtr<int> slow_value;
+  std::thread slow([&] {
+    slow_value = cache.get_or_create(-1, [&] {
+      in_factory = true;
+      while (!release) {
+        std::this_thread::yield();
+      }
+      return MakeShared<int>(-1);
+    });
+  });
+  while (!in_factory) {
+    std::this_thread::yield();
+  }
+  std::vector<SharedPtr<int>> values;
+  for (int i = 0; i < 5000; ++i) {
+    values.push_back(cache.get_or_emplace(i, i));
+  }
+  release = true;
+  slow.join();
+  assert(*slow_value == -1 && cache.get(-1).get() == slow_value.get());
+}
+
+void TestPruning() {
+  WeakValueCache<int, Object> cache;
+  std::vector<SharedPtr<Object>> kept;
+  for (int i = 0; i < 1000; ++i) {
+    auto value =
+        cache.get_or_create(i, [i] { return MakeShared<Object>(i); });
+    if (i % 10 == 0) {
+      kept.push_back(value);
+    }
+  }
+  cache.prune();
+  assert(cache.size() == 100);
+  kept.clear();
+  cache.start(std::chrono::milliseconds(5));
+  for (int i = 0; i < 100 && cache.size() != 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  cache.stop();
+  assert(cache.size() == 0 && cache.stats().pruned == 1000);
+}
+
+}  // namespace
+
+int main() {
+  TestLookups();
+  TestSingleConstruction();
+  TestThrowingFactory();
+  TestInsertsDuringFactory();
+  TestPruning();
+  std::puts("ok");
+}
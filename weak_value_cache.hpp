@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "concurrency.hpp"
+#include "smart_pointers.hpp"
+
+// Maps keys to objects owned elsewhere, holding only WeakPtrs so that the
+// cache never extends a lifetime. Keys are spread over shards, each a map
+// under a lock of its own. get_or_create() builds a missing value at most
+// once however many threads ask for it at the same time: the first marks
+// the entry as being built and calls the factory with no lock held, and
+// the others wait for it. Entries whose objects are gone are dropped when
+// a lookup finds them, when a shard has doubled since it was last pruned,
+// and by prune(), which start() also runs periodically.
+template <typename K, typename V, typename Policy = MultiThreadPolicy,
+          typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+class WeakValueCache {
+ public:
+  struct Stats {
+    // Lookups that found a live value, and ones that did not.
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Misses on an entry whose value had died.
+    uint64_t expired = 0;
+    // Dead entries dropped by pruning.
+    uint64_t pruned = 0;
+  };
+
+  explicit WeakValueCache(size_t shard_count = 16);
+
+  WeakValueCache(const WeakValueCache&) = delete;
+
+  WeakValueCache& operator=(const WeakValueCache&) = delete;
+
+  // Empty if there is no live value for key.
+  SharedPtr<V, Policy> get(const K& key);
+
+  // Returns the live value for key, or caches and returns factory(), which
+  // must return a SharedPtr<V, Policy>. If the factory throws, one of the
+  // waiting threads, if any, tries its own. The factory must not ask for
+  // key itself.
+  template <typename Factory>
+  SharedPtr<V, Policy> get_or_create(const K& key, Factory&& factory);
+
+  // Same, with the value built by MakeShared from args.
+  template <typename... Args>
+  SharedPtr<V, Policy> get_or_emplace(const K& key, Args&&... args) {
+    return get_or_create(key, [&] {
+      return MakeShared<V, Policy>(std::forward<Args>(args)...);
+    });
+  }
+
+  // Replaces whatever key maps to.
+  void put(const K& key, const SharedPtr<V, Policy>& value);
+
+  bool erase(const K& key);
+
+  // Drops every entry whose value has died. Returns how many.
+  size_t prune();
+
+  // Prunes every interval until stop() is called.
+  void start(std::chrono::milliseconds interval) {
+    sweeper_.start(interval, [this] { prune(); });
+  }
+
+  void stop() { sweeper_.stop(); }
+
+  // Entries, including dead ones not yet pruned.
+  size_t size() const;
+
+  Stats stats() const;
+
+  ~WeakValueCache() { stop(); }
+
+ private:
+  struct Entry {
+    WeakPtr<V, Policy> value;
+    // Set while a get_or_create() builds the value with the lock released.
+    bool creating = false;
+  };
+
+  using Map = std::unordered_map<K, Entry, Hash, KeyEqual>;
+
+  struct alignas(kCacheLineSize) Shard {
+    mutable std::mutex mutex;
+    std::condition_variable created;
+    Map entries;
+    // The size at which a lookup prunes the shard next.
+    size_t prune_at = kMinPruneAt;
+    Stats stats;
+  };
+
+  static constexpr size_t kMinPruneAt = 16;
+
+  Shard& shard_for(const K& key) {
+    return shards_[MixHash(Hash()(key)) % shard_count_];
+  }
+
+  // Called with the shard locked.
+  static size_t prune_shard(Shard& shard);
+
+  const size_t shard_count_;
+  std::unique_ptr<Shard[]> shards_;
+
+  PeriodicWorker sweeper_;
+};
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+WeakValueCache<K, V, Policy, Hash, KeyEqual>::WeakValueCache(
+    size_t shard_count)
+    : shard_count_(shard_count ? shard_count : 1),
+      shards_(new Shard[shard_count_]) {}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+SharedPtr<V, Policy> WeakValueCache<K, V, Policy, Hash, KeyEqual>::get(
+    const K& key) {
+  Shard& shard = shard_for(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.entries.find(key);
+  if (it != shard.entries.end() && !it->second.creating) {
+    SharedPtr<V, Policy> value = it->second.value.try_lock();
+    if (value.get_ptr_counter()) {
+      ++shard.stats.hits;
+      return value;
+    }
+    ++shard.stats.expired;
+    shard.entries.erase(it);
+  }
+  ++shard.stats.misses;
+  return SharedPtr<V, Policy>();
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+template <typename Factory>
+SharedPtr<V, Policy>
+WeakValueCache<K, V, Policy, Hash, KeyEqual>::get_or_create(
+    const K& key, Factory&& factory) {
+  Shard& shard = shard_for(key);
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  auto it = shard.entries.find(key);
+  while (it != shard.entries.end() && it->second.creating) {
+    shard.created.wait(lock);
+    it = shard.entries.find(key);
+  }
+  if (it != shard.entries.end()) {
+    SharedPtr<V, Policy> value = it->second.value.try_lock();
+    if (value.get_ptr_counter()) {
+      ++shard.stats.hits;
+      return value;
+    }
+    ++shard.stats.expired;
+  } else {
+    if (shard.entries.size() >= shard.prune_at) {
+      prune_shard(shard);
+    }
+    it = shard.entries.emplace(key, Entry()).first;
+  }
+  ++shard.stats.misses;
+  // Inserts while the lock is released may rehash the map, which
+  // invalidates iterators but not references. Nothing else erases an entry
+  // being created.
+  Entry& entry = it->second;
+  entry.creating = true;
+  lock.unlock();
+
+  SharedPtr<V, Policy> value;
+  try {
+    value = factory();
+  } catch (...) {
+    lock.lock();
+    shard.entries.erase(key);
+    shard.created.notify_all();
+    throw;
+  }
+
+  lock.lock();
+  entry.value = WeakPtr<V, Policy>(value);
+  entry.creating = false;
+  shard.created.notify_all();
+  return value;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void WeakValueCache<K, V, Policy, Hash, KeyEqual>::put(
+    const K& key, const SharedPtr<V, Policy>& value) {
+  Shard& shard = shard_for(key);
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  auto it = shard.entries.find(key);
+  while (it != shard.entries.end() && it->second.creating) {
+    shard.created.wait(lock);
+    it = shard.entries.find(key);
+  }
+  if (it == shard.entries.end()) {
+    if (shard.entries.size() >= shard.prune_at) {
+      prune_shard(shard);
+    }
+    it = shard.entries.emplace(key, Entry()).first;
+  }
+  it->second.value = WeakPtr<V, Policy>(value);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool WeakValueCache<K, V, Policy, Hash, KeyEqual>::erase(const K& key) {
+  Shard& shard = shard_for(key);
+  std::unique_lock<std::mutex> lock(shard.mutex);
+  auto it = shard.entries.find(key);
+  while (it != shard.entries.end() && it->second.creating) {
+    shard.created.wait(lock);
+    it = shard.entries.find(key);
+  }
+  if (it == shard.entries.end()) {
+    return false;
+  }
+  shard.entries.erase(it);
+  return true;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t WeakValueCache<K, V, Policy, Hash, KeyEqual>::prune_shard(
+    Shard& shard) {
+  size_t pruned = 0;
+  for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+    if (!it->second.creating && it->second.value.expired()) {
+      it = shard.entries.erase(it);
+      ++pruned;
+    } else {
+      ++it;
+    }
+  }
+  shard.stats.pruned += pruned;
+  shard.prune_at = std::max(kMinPruneAt, 2 * shard.entries.size());
+  return pruned;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t WeakValueCache<K, V, Policy, Hash, KeyEqual>::prune() {
+  size_t pruned = 0;
+  for (size_t i = 0; i < shard_count_; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    pruned += prune_shard(shards_[i]);
+  }
+  return pruned;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t WeakValueCache<K, V, Policy, Hash, KeyEqual>::size() const {
+  size_t size = 0;
+  for (size_t i = 0; i < shard_count_; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    size += shards_[i].entries.size();
+  }
+  return size;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+typename WeakValueCache<K, V, Policy, Hash, KeyEqual>::Stats
+WeakValueCache<K, V, Policy, Hash, KeyEqual>::stats() const {
+  Stats stats;
+  for (size_t i = 0; i < shard_count_; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    stats.hits += shards_[i].stats.hits;
+    stats.misses += shards_[i].stats.misses;
+    stats.expired += shards_[i].stats.expired;
+    stats.pruned += shards_[i].stats.pruned;
+  }
+  return stats;
+}